@@ -26,6 +26,7 @@ ENUM(action_id_t,
   FILE_CLOSE,
   FILE_SAVE,
   FILE_SAVE_AS,
+  FILE_SAVE_ALL,
   FILE_REPAINT,
   FILE_SUSPEND,
   FILE_EXIT,
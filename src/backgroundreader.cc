@@ -0,0 +1,100 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cerrno>
+#include <new>
+
+#include "tilde/backgroundreader.h"
+
+/* The worker hands over text in chunks of at least this size, to keep the locking and the
+   number of wake-ups of the UI thread low. */
+static const size_t kChunkSize = 256 * 1024;
+/* Maximum number of chunks waiting for the UI thread. This limits the memory used when the UI
+   thread can't keep up. */
+static const size_t kMaxChunks = 16;
+
+background_reader_t::background_reader_t(file_read_wrapper_t *_wrapper, bool _buffer_used)
+    : wrapper(_wrapper), buffer_used(_buffer_used) {
+  thread = std::thread(&background_reader_t::run, this);
+}
+
+background_reader_t::~background_reader_t() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cancelled = true;
+  }
+  space_available.notify_one();
+  thread.join();
+}
+
+bool background_reader_t::take_chunks(std::deque<std::string> *_chunks) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!chunks.empty()) {
+    _chunks->push_back(std::move(chunks.front()));
+    chunks.pop_front();
+  }
+  lock.unlock();
+  space_available.notify_one();
+  lock.lock();
+  return finished && chunks.empty();
+}
+
+rw_result_t background_reader_t::get_result() const { return result; }
+
+bool background_reader_t::get_buffer_used() const { return buffer_used; }
+
+void background_reader_t::run() {
+  std::string chunk;
+  rw_result_t stop_result;
+
+  try {
+    /* When the wrapper reports a problem, the text before it has already been appended to the
+       chunk. Loading can be continued by calling fill_buffer again. */
+    while (!buffer_used || wrapper->fill_buffer(wrapper->get_fill(), &stop_result)) {
+      buffer_used = false;
+      chunk.append(wrapper->get_buffer(), wrapper->get_fill());
+      buffer_used = true;
+      if (chunk.size() >= kChunkSize && !push_chunk(&chunk)) {
+        return;
+      }
+    }
+  } catch (std::bad_alloc &) {
+    stop_result = rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+
+  if (!chunk.empty() && !push_chunk(&chunk)) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    result = stop_result;
+    finished = true;
+  }
+  signal_update();
+}
+
+bool background_reader_t::push_chunk(std::string *chunk) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (chunks.size() >= kMaxChunks && !cancelled) {
+      space_available.wait(lock);
+    }
+    if (cancelled) {
+      return false;
+    }
+    chunks.push_back(std::move(*chunk));
+  }
+  chunk->clear();
+  signal_update();
+  return true;
+}
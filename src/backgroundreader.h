@@ -0,0 +1,73 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BACKGROUND_READER_H
+#define BACKGROUND_READER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "tilde/filestate.h"
+
+/** Reads and converts a file on a worker thread.
+
+    The converted text is collected in large chunks, which the UI thread picks up with
+    take_chunks and appends to the buffer. The worker stops at the end of the file, or at the
+    first problem reported by the file_read_wrapper_t. In the latter case the problem is available
+    from get_result once finished returns true, and loading can be continued (after asking the
+    user what to do) by creating a new background_reader_t for the same wrapper.
+
+    Only the worker thread touches the file_read_wrapper_t while the background_reader_t exists.
+*/
+class background_reader_t {
+ public:
+  /** Start reading.
+      @param wrapper The wrapper to read from.
+      @param buffer_used Whether the current contents of the wrapper's buffer have already been
+          used, as in load_process_t::buffer_used.
+  */
+  background_reader_t(file_read_wrapper_t *wrapper, bool buffer_used);
+  /** Stop the worker thread and wait for it to exit. Chunks not yet taken are discarded. */
+  ~background_reader_t();
+
+  /** Move the chunks converted so far to the end of @p chunks.
+      @return @c true if the worker has finished and all its chunks have been taken.
+  */
+  bool take_chunks(std::deque<std::string> *chunks);
+
+  /** Get the reason the worker stopped. Only valid once take_chunks has returned @c true. */
+  rw_result_t get_result() const;
+  /** Get the value for load_process_t::buffer_used after the worker stopped. */
+  bool get_buffer_used() const;
+
+ private:
+  void run();
+  bool push_chunk(std::string *chunk);
+
+  file_read_wrapper_t *wrapper;
+  bool buffer_used;
+
+  std::mutex mutex;
+  std::condition_variable space_available;
+  std::deque<std::string> chunks;
+  bool finished = false;
+  bool cancelled = false;
+  rw_result_t result;
+
+  std::thread thread;
+};
+
+#endif
@@ -0,0 +1,38 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cerrno>
+#include <new>
+#include <t3widget/widget.h>
+
+#include "tilde/backgroundtask.h"
+
+background_task_t::background_task_t(std::function<rw_result_t()> _task) : task(std::move(_task)) {
+  thread = std::thread(&background_task_t::run, this);
+}
+
+background_task_t::~background_task_t() { thread.join(); }
+
+bool background_task_t::is_finished() const { return finished.load(std::memory_order_acquire); }
+
+rw_result_t background_task_t::get_result() const { return result; }
+
+void background_task_t::run() {
+  try {
+    result = task();
+  } catch (std::bad_alloc &) {
+    result = rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+  finished.store(true, std::memory_order_release);
+  t3widget::signal_update();
+}
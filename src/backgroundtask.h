@@ -0,0 +1,50 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BACKGROUND_TASK_H
+#define BACKGROUND_TASK_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "tilde/filewrapper.h"
+
+/** Runs a single step of a stepped_process_t on a worker thread.
+
+    When the task is done, an update notification is sent, such that the process can pick up the
+    result on the UI thread. The task must only use data that the UI thread does not touch while
+    the background_task_t exists.
+*/
+class background_task_t {
+ public:
+  /** Start running @p task. Throws std::system_error if the thread can not be created. */
+  explicit background_task_t(std::function<rw_result_t()> task);
+  /** Wait for the task to finish. */
+  ~background_task_t();
+
+  /** Check whether the task has finished. */
+  bool is_finished() const;
+  /** Get the result of the task. Only valid once is_finished returns @c true. */
+  rw_result_t get_result() const;
+
+ private:
+  void run();
+
+  std::function<rw_result_t()> task;
+  std::atomic<bool> finished{false};
+  rw_result_t result;
+  std::thread thread;
+};
+
+#endif
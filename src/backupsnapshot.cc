@@ -0,0 +1,231 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <signal.h>
+#include <system_error>
+#include <t3widget/widget.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "tilde/backupsnapshot.h"
+#include "tilde/copy_file.h"
+
+/* The copies are mostly I/O bound, and usually reflinks. A second thread keeps a large copy from
+   delaying all others. */
+static const size_t kPoolThreads = 2;
+static const char kSnapshotInfix[] = ".tilde-backup-";
+
+/** The worker threads that make the copies of all backup_snapshot_t's. */
+class backup_snapshot_pool_t {
+ public:
+  /** Get the pool, which is created on first use. */
+  static backup_snapshot_pool_t &instance();
+  /** Stop the worker threads. Copies that are still queued are not made. */
+  ~backup_snapshot_pool_t();
+
+  /** Queue @p snapshot. Throws std::system_error if no worker thread can be created. */
+  void add(backup_snapshot_t *snapshot);
+  /** Remove @p snapshot from the queue, or wait for it to finish if a worker started on it. */
+  void cancel_or_wait(backup_snapshot_t *snapshot);
+
+ private:
+  void run();
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<backup_snapshot_t *> queue;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+};
+
+backup_snapshot_pool_t &backup_snapshot_pool_t::instance() {
+  static backup_snapshot_pool_t pool;
+  return pool;
+}
+
+backup_snapshot_pool_t::~backup_snapshot_pool_t() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+void backup_snapshot_pool_t::add(backup_snapshot_t *snapshot) {
+  std::unique_lock<std::mutex> lock(mutex);
+  // The threads are only started when the first copy is made, which is only if pre_backup is set.
+  while (threads.size() < kPoolThreads) {
+    try {
+      threads.emplace_back(&backup_snapshot_pool_t::run, this);
+    } catch (std::system_error &) {
+      if (threads.empty()) {
+        throw;
+      }
+      break;
+    }
+  }
+  queue.push_back(snapshot);
+  changed.notify_all();
+}
+
+void backup_snapshot_pool_t::cancel_or_wait(backup_snapshot_t *snapshot) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (snapshot->state == backup_snapshot_t::QUEUED) {
+    queue.erase(std::remove(queue.begin(), queue.end(), snapshot), queue.end());
+    snapshot->state = backup_snapshot_t::DONE;
+    return;
+  }
+  changed.wait(lock, [snapshot] { return snapshot->state == backup_snapshot_t::DONE; });
+}
+
+void backup_snapshot_pool_t::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    changed.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (stopping) {
+      return;
+    }
+    backup_snapshot_t *snapshot = queue.front();
+    queue.pop_front();
+    snapshot->state = backup_snapshot_t::RUNNING;
+    lock.unlock();
+    snapshot->run();
+    lock.lock();
+    snapshot->state = backup_snapshot_t::DONE;
+    changed.notify_all();
+    // A background save may be waiting for the copy.
+    t3widget::signal_update();
+  }
+}
+
+/* Remove the copies of the file @p base_name in @p dir_name that were made by tilde processes that
+   no longer exist. These are left behind when tilde is killed. */
+static void remove_stale_copies(const std::string &dir_name, const std::string &base_name) {
+  DIR *dir = opendir(dir_name.empty() ? "." : dir_name.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  std::string prefix = "." + base_name + kSnapshotInfix;
+  while (struct dirent *entry = readdir(dir)) {
+    if (strncmp(entry->d_name, prefix.data(), prefix.size()) != 0) {
+      continue;
+    }
+    // The rest of the name is <pid>-XXXXXX.
+    const char *pid_str = entry->d_name + prefix.size();
+    char *pid_end;
+    errno = 0;
+    long pid = strtol(pid_str, &pid_end, 10);
+    if (pid_end == pid_str || errno != 0 || pid <= 0 || pid == getpid() || *pid_end != '-' ||
+        strlen(pid_end + 1) != 6) {
+      continue;
+    }
+    if (kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH) {
+      unlink((dir_name + entry->d_name).c_str());
+    }
+  }
+  closedir(dir);
+}
+
+backup_snapshot_t::backup_snapshot_t(std::string _name, save_durability_t _durability)
+    : name(std::move(_name)),
+      durability(_durability == save_durability_t::DEFERRED ? save_durability_t::DATA
+                                                             : _durability) {
+  backup_snapshot_pool_t::instance().add(this);
+}
+
+backup_snapshot_t::~backup_snapshot_t() {
+  cancel_or_wait();
+  if (!snapshot_name.empty()) {
+    unlink(snapshot_name.c_str());
+  }
+}
+
+bool backup_snapshot_t::is_running() const { return state == RUNNING; }
+
+bool backup_snapshot_t::cancel_or_wait() {
+  backup_snapshot_pool_t::instance().cancel_or_wait(this);
+  return success;
+}
+
+bool backup_snapshot_t::matches(const struct stat &current_info) const {
+  return file_info.st_dev == current_info.st_dev && file_info.st_ino == current_info.st_ino &&
+         file_info.st_size == current_info.st_size &&
+         file_info.st_mtim.tv_sec == current_info.st_mtim.tv_sec &&
+         file_info.st_mtim.tv_nsec == current_info.st_mtim.tv_nsec;
+}
+
+save_durability_t backup_snapshot_t::get_durability() const { return durability; }
+
+std::string backup_snapshot_t::release() {
+  std::string result;
+  result.swap(snapshot_name);
+  return result;
+}
+
+void backup_snapshot_t::run() {
+  success = create_copy();
+  if (!success && !snapshot_name.empty()) {
+    unlink(snapshot_name.c_str());
+    snapshot_name.clear();
+  }
+}
+
+bool backup_snapshot_t::create_copy() {
+  int src_fd = open(name.c_str(), O_RDONLY);
+  if (src_fd < 0) {
+    return false;
+  }
+  if (fstat(src_fd, &file_info) != 0 || !S_ISREG(file_info.st_mode)) {
+    close(src_fd);
+    return false;
+  }
+
+  size_t idx = name.rfind('/');
+  idx = idx == std::string::npos ? 0 : idx + 1;
+  std::string dir_name = name.substr(0, idx);
+  std::string base_name = name.substr(idx);
+  remove_stale_copies(dir_name, base_name);
+
+  std::string temp_name_str = dir_name + "." + base_name + kSnapshotInfix +
+                              std::to_string(getpid()) + "-XXXXXX";
+  std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+  temp_name.push_back(0);
+  int dest_fd = mkstemp(temp_name.data());
+  if (dest_fd < 0) {
+    close(src_fd);
+    return false;
+  }
+  snapshot_name = temp_name.data();
+
+  /* The file may have been written while it was copied. The copy is only usable if it was not,
+     which is checked through the size and the modification time. */
+  struct stat after_info;
+  bool copied = copy_file(src_fd, dest_fd) == 0 && fstat(src_fd, &after_info) == 0 &&
+                matches(after_info) && sync_file(dest_fd, durability) == 0;
+  close(src_fd);
+  return close(dest_fd) == 0 && copied;
+}
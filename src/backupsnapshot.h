@@ -0,0 +1,80 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BACKUP_SNAPSHOT_H
+#define BACKUP_SNAPSHOT_H
+
+#include <atomic>
+#include <string>
+#include <sys/stat.h>
+
+#include "tilde/durability.h"
+
+class backup_snapshot_pool_t;
+
+/** Copies a file to a temporary backup file on a worker thread.
+
+    The copy is started when the file has been loaded, such that the first save can use it as its
+    backup instead of copying the file itself. The copy is made with copy_file, which creates a
+    reflink where the file system supports it. The copy is placed in the directory of the file, as
+    the backup made by the save would be, and is named .<name>.tilde-backup-<pid>-XXXXXX. Copies
+    left behind by tilde processes that no longer exist are removed when a new copy is made.
+
+    The copies of all buffers are made by a small pool of worker threads, so opening many files
+    does not start a thread for each of them.
+*/
+class backup_snapshot_t {
+ public:
+  /** Queue the copy of the file @p name. Throws std::system_error if no worker thread can be
+      created.
+      @param durability How the copy is flushed to disk once it is complete.
+  */
+  backup_snapshot_t(std::string name, save_durability_t durability);
+  /** Cancel or wait for the copy, and remove it unless it was released. */
+  ~backup_snapshot_t();
+
+  /** Check whether a worker is making the copy. */
+  bool is_running() const;
+  /** Cancel the copy if no worker has started on it yet, or wait for it to finish otherwise. A
+      save is not delayed by a queued copy, as making its own backup is no slower.
+      @return Whether the copy was made successfully.
+  */
+  bool cancel_or_wait();
+  /** Check whether the file described by @p current_info is the file that was copied, and has not
+      changed since. Only valid once cancel_or_wait has returned @c true. */
+  bool matches(const struct stat &current_info) const;
+  /** Get the durability the copy was flushed with. A deferred flush is done immediately, because
+      the copy is only useful as a backup if it is on disk before the file is overwritten. */
+  save_durability_t get_durability() const;
+  /** Get the name of the copy, and hand over the responsibility for removing it to the caller. */
+  std::string release();
+
+ private:
+  friend class backup_snapshot_pool_t;
+
+  enum state_t { QUEUED, RUNNING, DONE };
+
+  void run();
+  bool create_copy();
+
+  std::string name;
+  save_durability_t durability;
+  std::string snapshot_name;
+  // The state of the file when it was copied.
+  struct stat file_info;
+  bool success = false;
+  // Only changed with the mutex of the backup_snapshot_pool_t locked.
+  std::atomic<state_t> state{QUEUED};
+};
+
+#endif
@@ -4,7 +4,12 @@
 
 #include "tilde/copy_file.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <utility>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <t3widget/util.h>
@@ -12,6 +17,10 @@
 
 using namespace t3widget;
 
+#ifdef TILDE_UNITTEST
+std::function<void(off_t copied, ssize_t result)> copy_chunk_hook;
+#endif
+
 static bool rewind_files(int src_fd, int dest_fd) {
   if (lseek(src_fd, 0, SEEK_SET) == (off_t)-1) {
     return false;
@@ -22,6 +31,62 @@ static bool rewind_files(int src_fd, int dest_fd) {
   return true;
 }
 
+/* Number of times a system call is retried without progress, before copying is considered to have
+   failed. */
+static const int kMaxRetries = 16;
+// Number of bytes requested per call once the expected size has been copied.
+static const size_t kGrowthChunkSize = 1024 * 1024;
+
+/* Copy the source file to the destination file by calling copy_chunk until the end of the source
+   file is reached. copy_chunk is called with the maximum number of bytes to copy, and returns the
+   result of the system call it makes.
+
+   The file may change size while it is copied. If it shrinks, copy_chunk reports the end of the
+   file early, and the destination is truncated to the new size of the file. If it grows, copying
+   simply continues beyond expected_size. */
+template <typename CopyChunk>
+static int copy_until_eof(int src_fd, int dest_fd, size_t expected_size, CopyChunk copy_chunk) {
+  off_t copied = 0;
+  int retries = 0;
+  while (true) {
+    size_t remaining = static_cast<size_t>(copied) < expected_size ? expected_size - copied : 0;
+    ssize_t result = copy_chunk(std::max(remaining, kGrowthChunkSize));
+#ifdef TILDE_UNITTEST
+    if (result >= 0 && copy_chunk_hook) {
+      copy_chunk_hook(copied, result);
+    }
+#endif
+    if (result < 0) {
+      if ((errno == EINTR || errno == EAGAIN) && ++retries < kMaxRetries) {
+        continue;
+      }
+      return errno;
+    } else if (result == 0) {
+      /* Check that this is really the end of the file. Some file systems report no data for files
+         that do have data (such as files in /proc), in which case the method can't be used. */
+      struct stat statbuf;
+      if (fstat(src_fd, &statbuf) < 0) {
+        return errno;
+      }
+      if (statbuf.st_size <= copied) {
+        // Data copied before the file was truncated is no longer part of the file.
+        copied = statbuf.st_size;
+        break;
+      }
+      if (++retries >= kMaxRetries) {
+        return copied == 0 ? ENOTSUP : EIO;
+      }
+      continue;
+    }
+    retries = 0;
+    copied += result;
+  }
+  if (ftruncate(dest_fd, copied) < 0) {
+    return errno;
+  }
+  return 0;
+}
+
 #if defined(HAS_SENDFILE) && defined(__linux__)
 #include <sys/sendfile.h>
 
@@ -29,27 +94,72 @@ int copy_file_by_sendfile(int src_fd, int dest_fd, size_t bytes_to_copy) {
   if (!rewind_files(src_fd, dest_fd)) {
     return errno;
   }
+  return copy_until_eof(src_fd, dest_fd, bytes_to_copy, [src_fd, dest_fd](size_t max_bytes) {
+    return sendfile(dest_fd, src_fd, nullptr, max_bytes);
+  });
+}
+#else
+#if defined(TILDE_UNITTEST) && defined(__linux__)
+#error Please define HAS_SENDFILE in unit tests
+#endif
+int copy_file_by_sendfile(int, int, size_t) { return ENOTSUP; }
+#endif
+
+#if defined(HAS_SPLICE) && defined(__linux__)
+#include <fcntl.h>
+
+// Size requested for the pipe used by copy_file_by_splice. Larger pipes need fewer system calls.
+static const int kSplicePipeSize = 1024 * 1024;
 
-  ssize_t result;
-  do {
-    result = sendfile(dest_fd, src_fd, nullptr, bytes_to_copy);
+/* Move the in_pipe bytes in the pipe read through pipe_fd to dest_fd.
+   @return The number of bytes moved, or -1 on error. */
+static ssize_t drain_pipe(int pipe_fd, int dest_fd, ssize_t in_pipe) {
+  ssize_t drained = 0;
+  int retries = 0;
+  while (drained < in_pipe) {
+    ssize_t result = splice(pipe_fd, nullptr, dest_fd, nullptr, in_pipe - drained, SPLICE_F_MOVE);
     if (result < 0) {
-      if (errno == EAGAIN) {
+      if ((errno == EINTR || errno == EAGAIN) && ++retries < kMaxRetries) {
         continue;
       }
+      // The data in the pipe would be lost if the caller retried.
+      if (errno == EINTR || errno == EAGAIN) {
+        errno = EIO;
+      }
+      return -1;
     }
-    if (result < 0) {
-      return errno;
-    }
-    bytes_to_copy -= result;
-  } while (bytes_to_copy > 0);
-  return 0;
+    retries = 0;
+    drained += result;
+  }
+  return drained;
+}
+
+int copy_file_by_splice(int src_fd, int dest_fd, size_t bytes_to_copy) {
+  if (!rewind_files(src_fd, dest_fd)) {
+    return errno;
+  }
+
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+    return errno;
+  }
+  // The size of the pipe is limited by /proc/sys/fs/pipe-max-size, so failure is not an error.
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, kSplicePipeSize);
+
+  auto copy_chunk = [src_fd, dest_fd, &pipe_fds](size_t max_bytes) {
+    ssize_t in_pipe = splice(src_fd, nullptr, pipe_fds[1], nullptr, max_bytes, SPLICE_F_MOVE);
+    return in_pipe <= 0 ? in_pipe : drain_pipe(pipe_fds[0], dest_fd, in_pipe);
+  };
+  int error = copy_until_eof(src_fd, dest_fd, bytes_to_copy, copy_chunk);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  return error;
 }
 #else
 #if defined(TILDE_UNITTEST) && defined(__linux__)
-#error Please define HAS_SENDFILE in unit tests
+#error Please define HAS_SPLICE in unit tests
 #endif
-int copy_file_by_sendfile(int, int, size_t) { return ENOTSUP; }
+int copy_file_by_splice(int, int, size_t) { return ENOTSUP; }
 #endif
 
 #if defined(HAS_COPY_FILE_RANGE)
@@ -57,21 +167,9 @@ int copy_file_by_copy_file_range(int src_fd, int dest_fd, size_t bytes_to_copy)
   if (!rewind_files(src_fd, dest_fd)) {
     return errno;
   }
-
-  ssize_t result;
-  do {
-    result = copy_file_range(src_fd, nullptr, dest_fd, nullptr, bytes_to_copy, 0);
-    if (result < 0) {
-      if (errno == EAGAIN) {
-        continue;
-      }
-    }
-    if (result < 0) {
-      return errno;
-    }
-    bytes_to_copy -= result;
-  } while (bytes_to_copy > 0);
-  return 0;
+  return copy_until_eof(src_fd, dest_fd, bytes_to_copy, [src_fd, dest_fd](size_t max_bytes) {
+    return copy_file_range(src_fd, nullptr, dest_fd, nullptr, max_bytes, 0);
+  });
 }
 #else
 #if defined(TILDE_UNITTEST) && defined(__linux__)
@@ -97,10 +195,7 @@ int copy_file_by_ficlone(int src_fd, int dest_fd) {
 int copy_file_by_ficlone(int, int) { return ENOTSUP; }
 #endif
 
-int copy_file_by_read_write(int src_fd, int dest_fd) {
-  if (!rewind_files(src_fd, dest_fd)) {
-    return errno;
-  }
+static int copy_remaining_data(int src_fd, int dest_fd) {
   // Copy in chunks of 32K. This aims to balance memory use vs. number of operations.
   char buffer[32768];
   while (true) {
@@ -118,26 +213,227 @@ int copy_file_by_read_write(int src_fd, int dest_fd) {
   }
 }
 
-int copy_file(int src_fd, int dest_fd) {
-  int result;
+#if defined(HAS_SEEK_DATA)
+// Copy length bytes from src_offset in src_fd to dest_offset in dest_fd.
+static int copy_range(int src_fd, off_t src_offset, int dest_fd, off_t dest_offset, off_t length) {
+#if defined(HAS_COPY_FILE_RANGE)
+  while (length > 0) {
+    ssize_t result = copy_file_range(src_fd, &src_offset, dest_fd, &dest_offset, length, 0);
+    if (result < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      // Copying between file systems is not supported by all kernels. Copy the rest below.
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+        break;
+      }
+      return errno;
+    } else if (result == 0) {
+      // The source file was truncated while copying.
+      return 0;
+    }
+    length -= result;
+  }
+#endif
 
-  result = copy_file_by_ficlone(src_fd, dest_fd);
-  if (result == 0) {
-    return result;
+  char buffer[32768];
+  while (length > 0) {
+    ssize_t read_bytes = pread(src_fd, buffer, std::min<off_t>(length, sizeof(buffer)), src_offset);
+    if (read_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    } else if (read_bytes == 0) {
+      return 0;
+    }
+    for (ssize_t written_bytes = 0; written_bytes < read_bytes;) {
+      ssize_t result = pwrite(dest_fd, buffer + written_bytes, read_bytes - written_bytes,
+                              dest_offset + written_bytes);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      written_bytes += result;
+    }
+    src_offset += read_bytes;
+    dest_offset += read_bytes;
+    length -= read_bytes;
   }
+  return 0;
+}
 
+int copy_file_by_seek_data(int src_fd, int dest_fd, off_t offset) {
   struct stat statbuf;
   if (fstat(src_fd, &statbuf) < 0) {
     return errno;
   }
-  // FIXME: these routines may fail if the file changed in between and are now shorter!
-  result = copy_file_by_copy_file_range(src_fd, dest_fd, statbuf.st_size);
+  if (offset >= statbuf.st_size) {
+    return ENOTSUP;
+  }
+  /* File systems that don't track holes report the whole file as data. The end of the file counts
+     as a hole, so a file without holes has its first hole at the end. */
+  off_t hole = lseek(src_fd, offset, SEEK_HOLE);
+  if (hole < 0) {
+    return errno == EINVAL ? ENOTSUP : errno;
+  }
+  if (hole >= statbuf.st_size) {
+    return ENOTSUP;
+  }
+
+  // The regions that are not written must read as zeroes, as they do in the source.
+  if (ftruncate(dest_fd, 0) < 0) {
+    return errno;
+  }
+  /* The data regions are copied until the end of the file, rather than up to the size found
+     above, such that data appended while copying is copied as well. */
+  off_t data = offset;
+  while (true) {
+    if ((data = lseek(src_fd, data, SEEK_DATA)) < 0) {
+      if (errno == ENXIO) {
+        // Only a hole remains.
+        break;
+      }
+      return errno;
+    }
+    if ((hole = lseek(src_fd, data, SEEK_HOLE)) < 0) {
+      return errno;
+    }
+    int result = copy_range(src_fd, data, dest_fd, data - offset, hole - data);
+    if (result != 0) {
+      return result;
+    }
+    data = hole;
+  }
+  /* A hole at the end of the file is created by extending the destination to the full size. The
+     size is determined again, because the file may have shrunk or grown while it was copied. */
+  if (fstat(src_fd, &statbuf) < 0) {
+    return errno;
+  }
+  if (ftruncate(dest_fd, std::max<off_t>(statbuf.st_size - offset, 0)) < 0) {
+    return errno;
+  }
+  return 0;
+}
+#else
+#if defined(TILDE_UNITTEST) && defined(__linux__)
+#error Please define HAS_SEEK_DATA in unit tests
+#endif
+int copy_file_by_seek_data(int, int, off_t) { return ENOTSUP; }
+#endif
+
+int copy_file_by_read_write(int src_fd, int dest_fd) {
+  if (!rewind_files(src_fd, dest_fd)) {
+    return errno;
+  }
+  return copy_remaining_data(src_fd, dest_fd);
+}
+
+namespace {
+
+// copy_file is also used from the save task, so the cache is shared between threads.
+std::mutex copy_method_mutex;
+std::map<std::pair<dev_t, dev_t>, copy_method_t> copy_method_cache;
+
+}  // namespace
+
+copy_method_t get_cached_copy_method(dev_t src_dev, dev_t dest_dev) {
+  std::lock_guard<std::mutex> lock(copy_method_mutex);
+  auto iter = copy_method_cache.find(std::make_pair(src_dev, dest_dev));
+  return iter == copy_method_cache.end() ? copy_method_t::UNKNOWN : iter->second;
+}
+
+void clear_copy_method_cache() {
+  std::lock_guard<std::mutex> lock(copy_method_mutex);
+  copy_method_cache.clear();
+}
+
+static void set_cached_copy_method(const struct stat &src_stat, const struct stat &dest_stat,
+                                   copy_method_t method) {
+  std::lock_guard<std::mutex> lock(copy_method_mutex);
+  copy_method_cache[std::make_pair(src_stat.st_dev, dest_stat.st_dev)] = method;
+}
+
+/* Check whether error indicates that a copy method can not be used for the files, rather than
+   that copying failed. */
+static bool is_unsupported_error(int error) {
+  return error == ENOTSUP || error == EOPNOTSUPP || error == EXDEV || error == EINVAL ||
+         error == ENOSYS;
+}
+
+int copy_file(int src_fd, int dest_fd) {
+  int result;
+
+  struct stat src_stat, dest_stat;
+  if (fstat(src_fd, &src_stat) < 0 || fstat(dest_fd, &dest_stat) < 0) {
+    return errno;
+  }
+  copy_method_t method = get_cached_copy_method(src_stat.st_dev, dest_stat.st_dev);
+
+  if (method <= copy_method_t::CLONE) {
+    result = copy_file_by_ficlone(src_fd, dest_fd);
+    if (result == 0) {
+      set_cached_copy_method(src_stat, dest_stat, copy_method_t::CLONE);
+      return result;
+    }
+  }
+
+  // A clone shares the holes of the source, but the other methods fill them in.
+  result = copy_file_by_seek_data(src_fd, dest_fd, 0);
   if (result != ENOTSUP) {
     return result;
   }
-  result = copy_file_by_sendfile(src_fd, dest_fd, statbuf.st_size);
+
+  // The size is only a hint: the methods below copy until the end of the file.
+  if (method <= copy_method_t::COPY_FILE_RANGE) {
+    result = copy_file_by_copy_file_range(src_fd, dest_fd, src_stat.st_size);
+    if (result == 0) {
+      set_cached_copy_method(src_stat, dest_stat, copy_method_t::COPY_FILE_RANGE);
+    }
+    if (!is_unsupported_error(result)) {
+      return result;
+    }
+  }
+  if (method <= copy_method_t::SENDFILE) {
+    result = copy_file_by_sendfile(src_fd, dest_fd, src_stat.st_size);
+    if (result == 0) {
+      set_cached_copy_method(src_stat, dest_stat, copy_method_t::SENDFILE);
+    }
+    if (!is_unsupported_error(result)) {
+      return result;
+    }
+  }
+  if (method <= copy_method_t::SPLICE) {
+    result = copy_file_by_splice(src_fd, dest_fd, src_stat.st_size);
+    if (result == 0) {
+      set_cached_copy_method(src_stat, dest_stat, copy_method_t::SPLICE);
+    }
+    if (!is_unsupported_error(result)) {
+      return result;
+    }
+  }
+  result = copy_file_by_read_write(src_fd, dest_fd);
+  if (result == 0) {
+    set_cached_copy_method(src_stat, dest_stat, copy_method_t::READ_WRITE);
+  }
+  return result;
+}
+
+int copy_file_tail(int src_fd, int dest_fd, off_t offset) {
+  if (offset == 0) {
+    return copy_file(src_fd, dest_fd);
+  }
+  int result = copy_file_by_seek_data(src_fd, dest_fd, offset);
   if (result != ENOTSUP) {
     return result;
   }
-  return copy_file_by_read_write(src_fd, dest_fd);
+  if (lseek(src_fd, offset, SEEK_SET) == (off_t)-1) {
+    return errno;
+  }
+  if (lseek(dest_fd, 0, SEEK_SET) == (off_t)-1) {
+    return errno;
+  }
+  return copy_remaining_data(src_fd, dest_fd);
 }
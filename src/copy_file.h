@@ -2,15 +2,43 @@
 #define COPY_FILE_H_
 
 #include <cstddef>
+#include <sys/types.h>
 
 // Copy file by different methods. The files need not be at the starting position. The postion
-// after copy is undefined.
+// after copy is undefined. bytes_to_copy is the expected size of the file, but copying continues
+// until the end of the file, such that a file that shrinks or grows while copying is copied whole.
 int copy_file_by_sendfile(int src_fd, int dest_fd, size_t bytes_to_copy);
+int copy_file_by_splice(int src_fd, int dest_fd, size_t bytes_to_copy);
 int copy_file_by_copy_file_range(int src_fd, int dest_fd, size_t bytes_to_copy);
 int copy_file_by_ficlone(int src_fd, int dest_fd);
 int copy_file_by_read_write(int src_fd, int dest_fd);
+// Copy only the data regions of the part of the file from offset to the end, such that holes in
+// the source are holes in the destination as well. Returns ENOTSUP if the source has no holes, as
+// the other methods are faster in that case.
+int copy_file_by_seek_data(int src_fd, int dest_fd, off_t offset);
 
 // Generic copy routine which will try to copy the file using one of the methods above.
 int copy_file(int src_fd, int dest_fd);
 
+// The methods copy_file uses for files without holes, in the order in which they are tried.
+enum class copy_method_t { UNKNOWN, CLONE, COPY_FILE_RANGE, SENDFILE, SPLICE, READ_WRITE };
+
+// Get the method that copy_file last used successfully to copy from a file on device src_dev to a
+// file on device dest_dev. copy_file starts with that method, rather than retrying the methods
+// before it that failed. Cross-device copies are cached separately from copies within a device.
+copy_method_t get_cached_copy_method(dev_t src_dev, dev_t dest_dev);
+// Forget all cached copy methods.
+void clear_copy_method_cache();
+
+// Copy the part of the file from offset to the end to the start of dest_fd.
+int copy_file_tail(int src_fd, int dest_fd, off_t offset);
+
+#ifdef TILDE_UNITTEST
+#include <functional>
+// Called by the sendfile, splice and copy_file_range methods after each call that did not fail,
+// with the number of bytes copied before the call and by the call. This allows the tests to change
+// the source file while it is being copied.
+extern std::function<void(off_t copied, ssize_t result)> copy_chunk_hook;
+#endif
+
 #endif
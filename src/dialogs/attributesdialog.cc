@@ -14,6 +14,7 @@
 
 #include "tilde/dialogs/attributesdialog.h"
 
+#include "tilde/highlightcache.h"
 #include "tilde/option_access.h"
 
 struct attributes_dialog_t::attribute_access_t {
@@ -295,6 +296,8 @@ void attributes_dialog_t::set_options_from_values(term_options_t *term_options)
   option.brace_highlight = term_specific_option.brace_highlight.value_or(
       default_option.term_options.brace_highlight.value_or(get_default_attr(BRACE_HIGHLIGHT)));
   set_attributes();
+  // Definitions loaded from now on must use the new style mapping.
+  forget_shared_highlights();
 
   force_redraw_all();
 }
@@ -18,6 +18,7 @@
 #include <t3highlight/highlight.h>
 
 #include "tilde/dialogs/highlightdialog.h"
+#include "tilde/highlightcache.h"
 #include "tilde/main.h"
 #include "tilde/util.h"
 
@@ -98,10 +99,10 @@ void highlight_dialog_t::ok_activated() {
     return;
   }
 
-  if ((highlight =
-           t3_highlight_load(names.get()[idx - 1].lang_file, map_highlight, nullptr,
-                             T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH | T3_HIGHLIGHT_VERBOSE_ERROR,
-                             &error)) == nullptr) {
+  if ((highlight = load_shared_highlight(
+           names.get()[idx - 1].lang_file,
+           T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH | T3_HIGHLIGHT_VERBOSE_ERROR, &error)) ==
+      nullptr) {
     std::string message(_("Error loading highlighting patterns: "));
     if (error.file_name) {
       std::string file_location;
@@ -19,8 +19,22 @@
 
 static t3widget::key_t number_keys[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9'};
 
+// The durability levels in the order in which they are listed in the buffer options dialog.
+static const save_durability_t durability_levels[] = {
+    save_durability_t::FULL, save_durability_t::DATA, save_durability_t::DEFERRED,
+    save_durability_t::NONE};
+
+static size_t get_durability_index(save_durability_t durability) {
+  for (size_t i = 0; i < ARRAY_SIZE(durability_levels); ++i) {
+    if (durability_levels[i] == durability) {
+      return i;
+    }
+  }
+  return 0;
+}
+
 buffer_options_dialog_t::buffer_options_dialog_t(optional<std::string> _title)
-    : dialog_t(10, 25, std::move(_title)) {
+    : dialog_t(14, 25, std::move(_title)) {
   smart_label_t *label = emplace_back<smart_label_t>(_("_Tab size"));
   label->set_position(1, 2);
   tabsize_field = emplace_back<text_field_t>();
@@ -107,6 +121,19 @@ buffer_options_dialog_t::buffer_options_dialog_t(optional<std::string> _title)
 
   width = std::max<int>(label->get_width() + 2 + 3, width);
 
+  label_t *durability_label = emplace_back<label_t>(_("Save durability"));
+  durability_label->set_position(8, 2);
+  durability_list = emplace_back<list_pane_t>(true);
+  for (save_durability_t durability : durability_levels) {
+    durability_list->push_back(make_unique<label_t>(get_durability_name(durability)));
+  }
+  durability_list->set_size(ARRAY_SIZE(durability_levels), 10);
+  durability_list->set_anchor(this, T3_PARENT(T3_ANCHOR_TOPRIGHT) | T3_CHILD(T3_ANCHOR_TOPRIGHT));
+  durability_list->set_position(8, -2);
+  durability_list->connect_activate([this] { handle_activate(); });
+
+  width = std::max<int>(durability_label->get_width() + 2 + 10, width);
+
   button_t *ok_button = emplace_back<button_t>("_Ok", true);
   button_t *cancel_button = emplace_back<button_t>("_Cancel");
 
@@ -140,6 +167,7 @@ void buffer_options_dialog_t::set_values_from_view(file_edit_window_t *view) {
   indent_aware_home_box->set_state(view->get_indent_aware_home());
   show_tabs_box->set_state(view->get_show_tabs());
   strip_spaces_box->set_state(view->get_text()->get_strip_spaces());
+  durability_list->set_current(get_durability_index(view->get_text()->get_save_durability()));
 }
 
 void buffer_options_dialog_t::set_view_values(file_edit_window_t *view) {
@@ -153,6 +181,7 @@ void buffer_options_dialog_t::set_view_values(file_edit_window_t *view) {
   view->set_indent_aware_home(indent_aware_home_box->get_state());
   view->set_show_tabs(show_tabs_box->get_state());
   view->get_text()->set_strip_spaces(strip_spaces_box->get_state());
+  view->get_text()->set_save_durability(durability_levels[durability_list->get_current()]);
 }
 
 void buffer_options_dialog_t::set_values_from_options() {
@@ -166,6 +195,7 @@ void buffer_options_dialog_t::set_values_from_options() {
   indent_aware_home_box->set_state(option.indent_aware_home);
   show_tabs_box->set_state(option.show_tabs);
   strip_spaces_box->set_state(option.strip_spaces);
+  durability_list->set_current(get_durability_index(option.save_durability));
 }
 
 void buffer_options_dialog_t::set_options_from_values() {
@@ -179,6 +209,8 @@ void buffer_options_dialog_t::set_options_from_values() {
   default_option.indent_aware_home = option.indent_aware_home = indent_aware_home_box->get_state();
   default_option.show_tabs = option.show_tabs = show_tabs_box->get_state();
   default_option.strip_spaces = option.strip_spaces = strip_spaces_box->get_state();
+  default_option.save_durability = option.save_durability =
+      durability_levels[durability_list->get_current()];
 }
 
 void buffer_options_dialog_t::handle_activate() {
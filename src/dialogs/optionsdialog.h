@@ -27,6 +27,7 @@ class buffer_options_dialog_t : public dialog_t {
   checkbox_t *tab_spaces_box, *wrap_box, *hide_menu_box, *auto_indent_box, *indent_aware_home_box,
       *show_tabs_box, *strip_spaces_box;
   text_field_t *tabsize_field;
+  list_pane_t *durability_list;
 
  public:
   explicit buffer_options_dialog_t(optional<std::string> _title);
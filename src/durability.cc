@@ -0,0 +1,142 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cerrno>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <unistd.h>
+
+#include "tilde/durability.h"
+
+namespace {
+
+static const struct {
+  const char *name;
+  save_durability_t durability;
+} durability_names[] = {{"full", save_durability_t::FULL},
+                        {"data", save_durability_t::DATA},
+                        {"deferred", save_durability_t::DEFERRED},
+                        {"none", save_durability_t::NONE}};
+
+// The files queued by defer_sync, grouped by the device they are on.
+std::map<dev_t, std::set<std::string>> deferred_files;
+
+}  // namespace
+
+const char *get_durability_name(save_durability_t durability) {
+  for (const auto &mapping : durability_names) {
+    if (mapping.durability == durability) {
+      return mapping.name;
+    }
+  }
+  return "full";
+}
+
+bool parse_durability_name(const std::string &name, save_durability_t *durability) {
+  for (const auto &mapping : durability_names) {
+    if (name == mapping.name) {
+      *durability = mapping.durability;
+      return true;
+    }
+  }
+  return false;
+}
+
+int sync_file(int fd, save_durability_t durability) {
+  int result = 0;
+  switch (durability) {
+    case save_durability_t::FULL:
+      result = fsync(fd);
+      break;
+    case save_durability_t::DATA:
+#ifdef HAS_FDATASYNC
+      result = fdatasync(fd);
+#else
+      result = fsync(fd);
+#endif
+      break;
+    case save_durability_t::DEFERRED:
+    case save_durability_t::NONE:
+      break;
+  }
+  return result < 0 ? errno : 0;
+}
+
+int sync_parent_directory(const std::string &name, save_durability_t durability) {
+  if (durability != save_durability_t::FULL && durability != save_durability_t::DATA) {
+    return 0;
+  }
+  size_t idx = name.rfind('/');
+  std::string directory = idx == std::string::npos ? "." : name.substr(0, idx == 0 ? 1 : idx);
+  int fd;
+  while ((fd = open(directory.c_str(), O_RDONLY)) < 0) {
+    if (errno != EINTR) {
+      return errno;
+    }
+  }
+  int saved_errno = fsync(fd) < 0 ? errno : 0;
+  close(fd);
+  return saved_errno;
+}
+
+void defer_sync(const std::string &name, dev_t device) { deferred_files[device].insert(name); }
+
+/* Flush the file @p name, or if @p whole_file_system is set, the file system it is on.
+   @return 0 on success, ENOENT if the file no longer exists, or another errno value. */
+static int sync_name(const std::string &name, bool whole_file_system) {
+  int fd;
+  while ((fd = open(name.c_str(), O_RDONLY)) < 0) {
+    if (errno != EINTR) {
+      return errno;
+    }
+  }
+  int result;
+#ifdef HAS_SYNCFS
+  result = whole_file_system ? syncfs(fd) : fsync(fd);
+#else
+  (void)whole_file_system;
+  result = fsync(fd);
+#endif
+  int saved_errno = result < 0 ? errno : 0;
+  close(fd);
+  return saved_errno;
+}
+
+int flush_deferred_syncs() {
+  int first_error = 0;
+  for (const auto &device : deferred_files) {
+#ifdef HAS_SYNCFS
+    /* Any file on the file system will do for syncfs. Files that have been removed since they
+       were saved need not be flushed, so try the next one. */
+    for (const std::string &name : device.second) {
+      int error = sync_name(name, true);
+      if (error != ENOENT) {
+        if (first_error == 0) {
+          first_error = error;
+        }
+        break;
+      }
+    }
+#else
+    for (const std::string &name : device.second) {
+      int error = sync_name(name, false);
+      if (error != ENOENT && first_error == 0) {
+        first_error = error;
+      }
+    }
+#endif
+  }
+  deferred_files.clear();
+  return first_error;
+}
@@ -0,0 +1,65 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+#include <string>
+#include <sys/types.h>
+
+/** How much effort is made to ensure that a saved file survives a crash of the system. */
+enum class save_durability_t {
+  // Leave writing the file to disk to the operating system.
+  NONE,
+  // Queue the file for flush_deferred_syncs, which flushes many files at once.
+  DEFERRED,
+  // Flush the contents of the file, but only the metadata required to read them back.
+  DATA,
+  // Flush the contents and all metadata of the file.
+  FULL,
+};
+
+/** Get the name of @p durability, as used in the configuration file. */
+const char *get_durability_name(save_durability_t durability);
+/** Convert the name @p name to a save_durability_t.
+    @return @c false if @p name is not the name of a durability level.
+*/
+bool parse_durability_name(const std::string &name, save_durability_t *durability);
+
+/** Flush the data written to @p fd to disk, as far as required by @p durability.
+    @return 0 on success, or the @c errno value of the failed system call.
+
+    For save_durability_t::DEFERRED, the caller should use defer_sync after closing the file.
+*/
+int sync_file(int fd, save_durability_t durability);
+
+/** Flush the directory containing @p name, to make a rename of @p name durable.
+    @return 0 on success, or the @c errno value of the failed system call.
+
+    Only done for save_durability_t::FULL and save_durability_t::DATA, because the file can not
+    be found after a crash otherwise. A deferred flush covers the directory if syncfs is used.
+*/
+int sync_parent_directory(const std::string &name, save_durability_t durability);
+
+/** Queue the file @p name, which is on device @p device, for flush_deferred_syncs. */
+void defer_sync(const std::string &name, dev_t device);
+/** Flush all files queued by defer_sync.
+
+    Where available, a single syncfs call flushes all queued files on a file system, which is
+    much cheaper than flushing the files one by one if many files were saved.
+
+    @return 0 on success, or the @c errno value of the first failed system call.
+*/
+int flush_deferred_syncs();
+
+#endif
@@ -11,29 +11,64 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
+#include <limits>
+#include <system_error>
 #include <unistd.h>
+#ifdef HAS_XATTR
+#include <sys/xattr.h>
+#endif
 
+#include "tilde/backgroundreader.h"
+#include "tilde/backgroundtask.h"
 #include "tilde/copy_file.h"
 #include "tilde/filebuffer.h"
 #include "tilde/fileline.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightcache.h"
 #include "tilde/log.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
+#include "tilde/utf8check.h"
 
 #define CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
+// Files of at least this size are loaded in the background.
+static const off_t kBackgroundLoadSize = 4 * 1024 * 1024;
+// Maximum time spent appending text from a memory mapped file before handling user input again.
+static const std::chrono::milliseconds kLoadStepTime(50);
+// Maximum time spent computing the highlighting of lines before handling user input again.
+static const std::chrono::milliseconds kHighlightStepTime(20);
+/* When saving, text is passed to the wrapper in batches of roughly this size, to reduce the
+   overhead per call. */
+static const size_t kSaveBatchSize = 65536;
+
 file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
     : text_buffer_t(new file_line_factory_t(this)),
       behavior_parameters(new edit_window_t::behavior_parameters_t()),
       has_window(false),
       highlight_valid(0),
+      first_plain_line(std::numeric_limits<text_pos_t>::max()),
+      highlight_target(-1),
+      plain_line(nullptr),
+      highlight_generation(0),
       highlight_info(nullptr),
-      match_line(nullptr),
-      last_match(nullptr),
-      matching_brace_valid(false) {
+      scratch_match(nullptr),
+      matching_brace_valid(false),
+      load_complete(true),
+      load_cancel_requested(false),
+      load_progress(-1),
+      loader(nullptr),
+      window_first_line(0),
+      first_changed_line(std::numeric_limits<text_pos_t>::max()),
+      file_matches_buffer(false),
+      appending_file_text(false),
+      change_generation(0),
+      saver(nullptr) {
   if (_encoding.size() == 0) {
     encoding = "UTF-8";
   } else {
@@ -50,6 +85,8 @@ file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
   }
 
   connect_rewrap_required(bind_front(&file_buffer_t::invalidate_highlight, this));
+  connect_rewrap_required(bind_front(&file_buffer_t::track_changes, this));
+  highlight_connection = connect_update_notification([this] { continue_highlight(); });
 
   behavior_parameters->set_tabsize(option.tabsize);
   behavior_parameters->set_wrap(option.wrap ? wrap_type_t::WORD : wrap_type_t::NONE);
@@ -61,12 +98,28 @@ file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
 }
 
 file_buffer_t::~file_buffer_t() {
+  if (loader != nullptr) {
+    loader->abandon_file();
+  }
+  if (saver != nullptr) {
+    saver->abandon_file();
+  }
   open_files.erase(this);
-  t3_highlight_free(highlight_info);
-  t3_highlight_free_match(last_match);
+  highlight_connection.disconnect();
+  release_shared_highlight(highlight_info);
+  t3_highlight_free_match(scratch_match);
   delete get_line_factory();
 }
 
+/* Check whether the file described by @p current is still in the state described by @p recorded,
+   such as the state recorded by record_file_state. */
+static bool same_file_state(const struct stat &current, const struct stat &recorded) {
+  return current.st_dev == recorded.st_dev && current.st_ino == recorded.st_ino &&
+         current.st_size == recorded.st_size &&
+         current.st_mtim.tv_sec == recorded.st_mtim.tv_sec &&
+         current.st_mtim.tv_nsec == recorded.st_mtim.tv_nsec;
+}
+
 rw_result_t file_buffer_t::load(load_process_t *state) {
   t3_highlight_t *highlight = nullptr;
   t3_highlight_lang_t lang;
@@ -77,12 +130,10 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
     PANIC();
   }
 
+  load_progress = -1;
   switch (state->state) {
     case load_process_t::INITIAL_MISSING_OK:
     case load_process_t::INITIAL: {
-      transcript_t *handle;
-      transcript_error_t error;
-
       std::string _name = canonicalize_path(name.c_str());
       if (_name.empty()) {
         if (errno == ENOENT && state->state == load_process_t::INITIAL_MISSING_OK) {
@@ -102,70 +153,142 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
         return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
       }
 
-      try {
-        lprintf("Using encoding %s to read %s\n", encoding.c_str(), name.c_str());
+      struct stat file_info;
+      memset(&file_info, 0, sizeof(file_info));
+      if (fstat(state->fd, &file_info) == 0 && S_ISREG(file_info.st_mode)) {
+        state->file_size = file_info.st_size;
+        state->background = file_info.st_size >= kBackgroundLoadSize;
+      }
+
+      lprintf("Using encoding %s to read %s\n", encoding.c_str(), name.c_str());
 
-        handle = transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8, 0, &error);
-        if (handle == nullptr) {
-          return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+      if (transcript_equal(encoding.c_str(), "utf8")) {
+        /* UTF-8 files are validated while they are appended to the buffer. If an invalid sequence
+           is found, load_mapped switches to the converter. */
+        try {
+          if (state->prefetched != nullptr && state->prefetched->matches(file_info)) {
+            state->mapping = std::move(state->prefetched->mapping);
+            state->mapping_valid = state->prefetched->valid_utf8;
+          } else {
+            state->mapping = mapped_file_t::create(state->fd);
+          }
+          state->prefetched.reset();
+          if (state->mapping != nullptr) {
+            state->mapped_end = state->mapping->size();
+            if (option.large_file_size > 0 &&
+                state->mapping->size() / (1024 * 1024) >= option.large_file_size) {
+              line_index.reset(new line_index_t(name, file_info));
+              state->background = true;
+            }
+          }
+        } catch (std::bad_alloc &ba) {
+          return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
         }
-        // FIXME: if the new fails, the handle will remain open!
-        state->wrapper = new file_read_wrapper_t(state->fd, handle);
+      }
 
-      } catch (std::bad_alloc &ba) {
-        return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+      if (state->mapping == nullptr) {
+        rw_result_t result = open_wrapper(state, encoding.c_str());
+        if (result != rw_result_t::SUCCESS) {
+          return result;
+        }
       }
-      state->state = load_process_t::READING_FIRST;
+      state->state = state->mapping == nullptr ? load_process_t::READING_FIRST
+                                               : load_process_t::READING_MAPPED;
     }
+    // FALLTHROUGH
+    case load_process_t::READING_MAPPED:
+      if (state->state == load_process_t::READING_MAPPED) {
+        rw_result_t result = load_mapped(state);
+        if (result != rw_result_t::SUCCESS) {
+          return result;
+        }
+        if (state->state == load_process_t::READING_MAPPED) {
+          break;
+        }
+      }
+    // FALLTHROUGH
     case load_process_t::READING:
-    case load_process_t::READING_FIRST:
-      try {
-        while (!state->buffer_used || state->wrapper->fill_buffer(state->wrapper->get_fill())) {
-          state->buffer_used = false;
-          if (state->state == load_process_t::READING_FIRST) {
-            switch (state->bom_state) {
-              case load_process_t::UNKNOWN:
-                if (state->wrapper->get_fill() >= 3 && transcript_equal(encoding.c_str(), "utf8") &&
-                    memcmp(state->wrapper->get_buffer(), "\xef\xbb\xbf", 3) == 0) {
-                  return rw_result_t(rw_result_t::BOM_FOUND);
-                }
-                break;
-              case load_process_t::PRESERVE_BOM:
-                encoding = "X-UTF-8-BOM";
-              /* FALLTHROUGH */
-              case load_process_t::REMOVE_BOM:
-                try {
-                  append_text(string_view(state->wrapper->get_buffer() + 3,
-                                          state->wrapper->get_fill() - 3));
-                  state->buffer_used = true;
-                } catch (...) {
-                  return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
-                }
-                state->state = load_process_t::READING;
-                continue;
-              default:
-                break;
-            }
-            state->state = load_process_t::READING;
+    case load_process_t::READING_FIRST: {
+      rw_result_t event;
+      while (!state->buffer_used ||
+             state->wrapper->fill_buffer(state->wrapper->get_fill(), &event)) {
+        state->buffer_used = false;
+        if (state->state == load_process_t::READING && state->background) {
+          /* The BOM has been handled, so the rest of the file can be read by the
+             background_reader_t, starting with the unused data in the buffer. */
+          if (!has_window) {
+            set_cursor({0, 0});
           }
-
-          try {
-            append_text(string_view(state->wrapper->get_buffer(), state->wrapper->get_fill()));
-            state->buffer_used = true;
-          } catch (...) {
-            return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+          state->state = load_process_t::READING_BACKGROUND;
+          break;
+        }
+        if (state->state == load_process_t::READING_FIRST) {
+          switch (state->bom_state) {
+            case load_process_t::UNKNOWN:
+              if (state->wrapper->get_fill() >= 3 && transcript_equal(encoding.c_str(), "utf8") &&
+                  memcmp(state->wrapper->get_buffer(), "\xef\xbb\xbf", 3) == 0) {
+                return rw_result_t(rw_result_t::BOM_FOUND);
+              }
+              break;
+            case load_process_t::PRESERVE_BOM:
+              encoding = "X-UTF-8-BOM";
+            /* FALLTHROUGH */
+            case load_process_t::REMOVE_BOM:
+              try {
+                append_file_text(string_view(state->wrapper->get_buffer() + 3,
+                                             state->wrapper->get_fill() - 3));
+                state->buffer_used = true;
+              } catch (...) {
+                return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+              }
+              state->state = load_process_t::READING;
+              continue;
+            default:
+              break;
           }
+          state->state = load_process_t::READING;
+        }
+
+        try {
+          append_file_text(string_view(state->wrapper->get_buffer(), state->wrapper->get_fill()));
+          state->buffer_used = true;
+        } catch (...) {
+          return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
         }
+      }
+      if (event != rw_result_t::SUCCESS) {
+        return event;
+      }
+      if (state->state != load_process_t::READING_BACKGROUND) {
         set_cursor({0, 0});
-      } catch (rw_result_t &result) {
-        state->buffer_used = false;
+        break;
+      }
+    }
+    // FALLTHROUGH
+    case load_process_t::READING_BACKGROUND: {
+      rw_result_t result = load_background(state);
+      if (result != rw_result_t::SUCCESS) {
         return result;
       }
       break;
+    }
     default:
       PANIC();
   }
 
+  /* Text read through the converter may differ from the bytes in the file, so only a complete
+     load straight from the mapped file allows saving just the changed lines later. The file must
+     not have changed while it was loaded. */
+  struct stat loaded_info;
+  bool loaded_verbatim = load_complete && line_index == nullptr && state->mapping != nullptr &&
+                         encoding == "UTF-8" &&
+                         memcmp(state->mapping->data(), "\xef\xbb\xbf",
+                                std::min<size_t>(3, state->mapping->size())) != 0 &&
+                         fstat(state->fd, &loaded_info) == 0 &&
+                         same_file_state(loaded_info, state->mapping->get_file_info());
+  record_file_state(state->fd, loaded_verbatim);
+  start_pre_backup(state->fd);
+
   /* Automatically load appropriate highlighting patterns if available.
      Try the following in order:
      - a vi(m) modeline/Emacs major mode spec in the first five lines
@@ -196,15 +319,15 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
     success = t3_highlight_lang_by_filename(name.c_str(), T3_HIGHLIGHT_UTF8, &lang, nullptr);
   }
   if (success) {
-    highlight = t3_highlight_load(lang.lang_file, map_highlight, nullptr,
-                                  T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH
+    highlight = load_shared_highlight(lang.lang_file,
+                                      T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH
 /* If T3_HIGHLIGHT_USE_SCOPE is not available, all the other code is still compatible, so we simply
    omit the flag here. */
 #ifdef T3_HIGHLIGHT_USE_SCOPE
-                                      | T3_HIGHLIGHT_USE_SCOPE
+                                          | T3_HIGHLIGHT_USE_SCOPE
 #endif
-                                  ,
-                                  nullptr);
+                                      ,
+                                      nullptr);
     set_highlight(highlight);
     std::map<std::string, std::string>::iterator iter = option.line_comment_map.find(lang.name);
     if (iter != option.line_comment_map.end()) {
@@ -215,6 +338,297 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
   return rw_result_t(rw_result_t::SUCCESS);
 }
 
+/* Get the size of the part of the mapped file that can be loaded. If the file was truncated since
+   it was mapped, that is the new size of the file. */
+size_t file_buffer_t::get_mapped_file_size(const load_process_t *state) {
+  size_t size = state->mapping->get_intact_size();
+  struct stat file_info;
+  if (fstat(state->fd, &file_info) == 0 && static_cast<uintmax_t>(file_info.st_size) < size) {
+    size = file_info.st_size;
+  }
+  return size;
+}
+
+rw_result_t file_buffer_t::load_mapped(load_process_t *state) {
+  /* Text is appended in pieces of roughly this size, each ending at a line boundary. This keeps
+     the temporary line that append_text builds small, instead of copying the whole file. */
+  static const size_t kMappedChunkSize = 65536;
+  const char *data = state->mapping->data();
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + kLoadStepTime;
+
+  if (load_cancel_requested) {
+    load_complete = false;
+    return rw_result_t(rw_result_t::SUCCESS);
+  }
+
+  // Loading stops at the end of the file, if it was truncated since it was mapped.
+  size_t file_size = get_mapped_file_size(state);
+  if (line_index != nullptr && !line_index->is_complete()) {
+    if (!line_index->build(data, file_size, deadline)) {
+      update_load_progress(line_index->get_scanned_size(), file_size);
+      signal_update();
+      return rw_result_t(rw_result_t::LOAD_IN_PROGRESS);
+    }
+    select_window(state);
+  }
+  state->mapped_end = std::min(state->mapped_end, file_size);
+  const char *end = data + state->mapped_end;
+
+  if (state->mapped_offset == 0) {
+    if (state->mapping->size() >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) {
+      switch (state->bom_state) {
+        case load_process_t::UNKNOWN:
+          return rw_result_t(rw_result_t::BOM_FOUND);
+        case load_process_t::PRESERVE_BOM:
+          encoding = "X-UTF-8-BOM";
+        /* FALLTHROUGH */
+        case load_process_t::REMOVE_BOM:
+          state->mapped_offset = 3;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  try {
+    const char *chunk_start = data + state->mapped_offset;
+    while (chunk_start < end) {
+      const char *chunk_end = end;
+      if (static_cast<size_t>(end - chunk_start) > kMappedChunkSize) {
+        const char *newline = static_cast<const char *>(
+            memrchr(chunk_start, '\n', kMappedChunkSize));
+        if (newline != nullptr) {
+          chunk_end = newline + 1;
+        } else {
+          // Very long line: split it, but not in the middle of a UTF-8 sequence.
+          chunk_end = chunk_start + kMappedChunkSize;
+          while (chunk_end > chunk_start && (*chunk_end & 0xC0) == 0x80) {
+            --chunk_end;
+          }
+        }
+      }
+      bool valid = chunk_end > chunk_start &&
+                   (state->mapping_valid ||
+                    find_invalid_utf8(chunk_start, chunk_end - chunk_start) == nullptr);
+      if (state->mapping->get_intact_size() < static_cast<size_t>(chunk_end - data)) {
+        // The file was truncated while the chunk was read, so part of it is no longer valid.
+        state->mapped_end = std::min(state->mapped_end, get_mapped_file_size(state));
+        end = data + state->mapped_end;
+        continue;
+      }
+      if (!valid && line_index == nullptr) {
+        return switch_to_wrapper(state);
+      }
+      if (!valid) {
+        /* The converter would read the rest of the file, instead of only the window. Because
+           the window can't be saved anyway, simply substitute the invalid sequences. */
+        if (chunk_end == chunk_start) {
+          chunk_end = std::min(chunk_start + kMappedChunkSize, end);
+        }
+        std::string replaced;
+        replace_invalid_utf8(chunk_start, chunk_end - chunk_start, &replaced);
+        append_loaded_text(replaced);
+      } else if (state->background) {
+        append_loaded_text(string_view(chunk_start, chunk_end - chunk_start));
+      } else {
+        append_file_text(string_view(chunk_start, chunk_end - chunk_start));
+      }
+      state->mapped_offset = chunk_end - data;
+      chunk_start = chunk_end;
+
+      if (state->background && chunk_start < end && std::chrono::steady_clock::now() >= deadline) {
+        update_load_progress(state->mapped_offset - state->mapped_start,
+                             state->mapped_end - state->mapped_start);
+        // Continue appending after the UI has had a chance to handle input and update the screen.
+        signal_update();
+        return rw_result_t(rw_result_t::LOAD_IN_PROGRESS);
+      }
+    }
+  } catch (...) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+  if (!state->background) {
+    set_cursor({0, 0});
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+void file_buffer_t::select_window(load_process_t *state) {
+  /* Lines before the requested line are included, such that there is some context. */
+  static const text_pos_t kWindowContextLines = 1000;
+  const char *data = state->mapping->data();
+  size_t size = get_mapped_file_size(state);
+  size_t window_size = option.large_file_size * 1024 * 1024;
+
+  window_first_line = std::max<text_pos_t>(0, state->window_line - 1 - kWindowContextLines);
+  // The index may include lines past the end of a file that was truncated while it was indexed.
+  state->mapped_offset =
+      std::min(line_index->get_line_offset(data, size, window_first_line), size);
+  state->mapped_end = size;
+  if (size - state->mapped_offset > window_size) {
+    const char *window_start = data + state->mapped_offset;
+    const char *newline = static_cast<const char *>(memrchr(window_start, '\n', window_size));
+    if (newline != nullptr) {
+      state->mapped_end = newline + 1 - data;
+    } else {
+      state->mapped_end = state->mapped_offset + window_size;
+      while (state->mapped_end > state->mapped_offset && (data[state->mapped_end] & 0xC0) == 0x80) {
+        --state->mapped_end;
+      }
+    }
+  }
+  state->mapped_start = state->mapped_offset;
+  // The buffer does not contain the whole file, so it must not be saved over the file.
+  load_complete = false;
+}
+
+rw_result_t file_buffer_t::switch_to_wrapper(load_process_t *state) {
+  /* Continue with the converter from the start of the piece containing the invalid sequence, such
+     that the user is asked what to do with it. Pieces start at a line boundary or a character
+     boundary, so the converter does not need any of the text before it. A BOM has already been
+     handled, so the converter should not see the changed encoding name. */
+  if (lseek(state->fd, state->mapped_offset, SEEK_SET) < 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  state->mapping.reset();
+  rw_result_t result = open_wrapper(state, "UTF-8");
+  if (result != rw_result_t::SUCCESS) {
+    return result;
+  }
+  state->state =
+      state->mapped_offset == 0 ? load_process_t::READING_FIRST : load_process_t::READING;
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+rw_result_t file_buffer_t::open_wrapper(load_process_t *state, const char *wrapper_encoding) {
+  transcript_t *handle;
+  transcript_error_t error;
+
+  try {
+    handle = transcript_open_converter(wrapper_encoding, TRANSCRIPT_UTF8, 0, &error);
+    if (handle == nullptr) {
+      return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+    }
+    // Large files are converted using multiple threads, if the encoding allows it.
+    const char *parallel_encoding =
+        state->background && parallel_transcript_buffer_t::is_supported(wrapper_encoding)
+            ? wrapper_encoding
+            : nullptr;
+    // FIXME: if the new fails, the handle will remain open!
+    state->wrapper = new file_read_wrapper_t(state->fd, handle, parallel_encoding);
+  } catch (std::bad_alloc &ba) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+rw_result_t file_buffer_t::load_background(load_process_t *state) {
+  if (load_cancel_requested) {
+    delete state->reader;
+    state->reader = nullptr;
+    load_complete = false;
+    return rw_result_t(rw_result_t::SUCCESS);
+  }
+
+  if (state->reader == nullptr) {
+    try {
+      state->reader = new background_reader_t(state->wrapper, state->buffer_used);
+    } catch (std::bad_alloc &) {
+      return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+    } catch (std::system_error &error) {
+      return rw_result_t(rw_result_t::ERRNO_ERROR, error.code().value());
+    }
+  }
+
+  std::deque<std::string> chunks;
+  bool finished = state->reader->take_chunks(&chunks);
+  try {
+    for (const std::string &chunk : chunks) {
+      append_loaded_text(chunk);
+    }
+  } catch (...) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+
+  if (!finished) {
+    // The file offset is changed by the reader thread, but it is only used as an indication.
+    update_load_progress(lseek(state->fd, 0, SEEK_CUR), state->file_size);
+    return rw_result_t(rw_result_t::LOAD_IN_PROGRESS);
+  }
+
+  rw_result_t result = state->reader->get_result();
+  state->buffer_used = state->reader->get_buffer_used();
+  delete state->reader;
+  state->reader = nullptr;
+  return result;
+}
+
+void file_buffer_t::append_file_text(string_view text) {
+  appending_file_text = true;
+  try {
+    append_text(text);
+  } catch (...) {
+    appending_file_text = false;
+    throw;
+  }
+  appending_file_text = false;
+}
+
+void file_buffer_t::append_loaded_text(string_view text) {
+  // The buffer may already be shown, so the user's cursor position should not be affected.
+  text_coordinate_t cursor = get_cursor();
+  append_file_text(text);
+  set_cursor(cursor);
+}
+
+void file_buffer_t::record_file_state(int fd, bool matches_buffer) {
+  file_matches_buffer = matches_buffer && fd >= 0 && fstat(fd, &file_info) == 0;
+}
+
+void file_buffer_t::start_pre_backup(int fd) {
+  pre_backup.reset();
+  struct stat info;
+  if (!option.pre_backup || !load_complete || fd < 0 || fstat(fd, &info) != 0 ||
+      !S_ISREG(info.st_mode) || info.st_size == 0) {
+    return;
+  }
+  try {
+    pre_backup.reset(new backup_snapshot_t(name, get_save_durability()));
+  } catch (std::bad_alloc &) {
+  } catch (std::system_error &) {
+    // Without a thread, the first save simply copies the file itself.
+  }
+}
+
+void file_buffer_t::update_load_progress(off_t done, off_t total) {
+  if (total <= 0 || done < 0) {
+    load_progress = 0;
+  } else {
+    load_progress = static_cast<int>(std::min(done, total) * 100 / total);
+  }
+}
+
+int file_buffer_t::get_load_progress() const { return load_progress; }
+
+bool file_buffer_t::is_load_complete() const { return load_complete; }
+
+bool file_buffer_t::is_saving() const { return saver != nullptr; }
+
+void file_buffer_t::discard_pre_backup() { pre_backup.reset(); }
+
+const line_index_t *file_buffer_t::get_line_index() const { return line_index.get(); }
+
+text_pos_t file_buffer_t::get_window_first_line() const { return window_first_line; }
+
+void file_buffer_t::cancel_load() {
+  if (loader != nullptr) {
+    load_cancel_requested = true;
+    // Make the load_process_t run, such that it notices the request.
+    signal_update();
+  }
+}
+
 /* FIXME: try to prevent as many race conditions as possible here. */
 rw_result_t file_buffer_t::save(save_as_process_t *state) {
   size_t idx;
@@ -225,6 +639,16 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
 
   switch (state->state) {
     case save_as_process_t::INITIAL: {
+      /* Writing a partially loaded buffer to the file it was loaded from would truncate the file.
+         Saving under a different name is allowed once loading has stopped. */
+      if (loader != nullptr ||
+          (!load_complete &&
+           (state->name.empty() || canonicalize_path(state->name.c_str()) == name))) {
+        return rw_result_t(rw_result_t::LOAD_INCOMPLETE);
+      }
+      if (saver != nullptr) {
+        return rw_result_t(rw_result_t::ALREADY_SAVING);
+      }
       if (strip_spaces.is_valid() ? strip_spaces.value() : option.strip_spaces) {
         do_strip_spaces();
       }
@@ -244,30 +668,48 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       } else {
         state->conversion_handle = nullptr;
       }
-      state->wrapper = t3widget::make_unique<file_write_wrapper_t>(-1, state->conversion_handle);
+      state->staged = t3widget::make_unique<staged_output_t>();
+      state->wrapper = t3widget::make_unique<file_write_wrapper_t>(state->staged.get(),
+                                                                   state->conversion_handle);
       state->i = 0;
+      state->delta_offset = -1;
+
+      /* If the file still contains the unchanged lines before the first changed line, only the
+         rest needs to be written. This requires that the text is saved without conversion,
+         because the length of the converted unchanged lines is not known otherwise. The
+         separator before the first changed line is written again, such that the staging below
+         does not need to treat the first line specially. */
+      struct stat current_info;
+      if (state->conversion_handle == nullptr && state->name.empty() && file_matches_buffer &&
+          first_changed_line > 0 && stat(name.c_str(), &current_info) == 0 &&
+          same_file_state(current_info, file_info)) {
+        text_pos_t first_line = std::min(first_changed_line, size());
+        off_t offset = first_line - 1;
+        for (text_pos_t j = 0; j < first_line; ++j) {
+          offset += get_line_data(j).get_data().size();
+        }
+        state->i = first_line;
+        state->delta_offset = offset;
+      }
+      /* When several files are saved at once, flushing each of them is replaced by a flush of all
+         of them once the last one has been written. */
+      state->durability = get_save_durability();
+      if (state->batch_sync && state->durability != save_durability_t::NONE) {
+        state->durability = save_durability_t::DEFERRED;
+      }
+      state->snapshot_generation = change_generation;
+      if (state->background) {
+        take_snapshot(state);
+      }
       state->state = save_as_process_t::OPEN_FILE;
     }
       // FALLTHROUGH
     case save_as_process_t::OPEN_FILE: {
-      if (state->conversion_handle) {
-        transcript_from_unicode_reset(state->conversion_handle);
-      }
-      try {
-        for (; state->i < size(); state->i++) {
-          if (state->i != 0) {
-            state->wrapper->write("\n", 1);
-          }
-          const std::string &data = get_line_data(state->i).get_data();
-          /* At this point the wrapper is initialized with -1 as fd, thus it is not writing
-             anything. However, it will catch conversion errors, and this will result in asking
-             the user what to do. */
-          state->wrapper->write(data.data(), data.size());
-        }
-      } catch (rw_result_t error) {
-        return error;
+      rw_result_t result =
+          state->background ? run_save_task(state, stage_snapshot) : stage_lines(state);
+      if (result != rw_result_t::SUCCESS) {
+        return result;
       }
-      state->computed_length = state->wrapper->written_size();
 
       if (state->name.empty()) {
         if (name.empty()) {
@@ -337,106 +779,138 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       }
       // FALLTHROUGH
     case save_as_process_t::CREATE_BACKUP: {
-      // If the creation of the backup file fails, the user either aborts or allows continuation
-      // without completing the backup. Thus the next state is always WRITING.
-      state->state = save_as_process_t::WRITING;
-      std::string temp_name_str = state->real_name;
-
-      if (option.make_backup) {
-        temp_name_str += "~";
-        if ((state->backup_fd = open(temp_name_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) <
-            0) {
-          return rw_result_t(rw_result_t::BACKUP_FAILED, errno);
+      /* A background save waits for the copy started by the load, without blocking the user. A
+         copy that has not been started yet is cancelled in use_pre_backup. */
+      if (state->background && pre_backup != nullptr && pre_backup->is_running()) {
+        state->state = save_as_process_t::CREATE_BACKUP;
+        return rw_result_t(rw_result_t::SAVE_IN_PROGRESS);
+      }
+      if (state->delta_offset >= 0) {
+        struct stat current_info;
+        if (fstat(state->fd, &current_info) != 0 || !same_file_state(current_info, file_info)) {
+          /* The file was changed after the check in INITIAL, so it must be written completely.
+             This is rare enough to simply do it here, also for a background save. */
+          state->staged = t3widget::make_unique<staged_output_t>();
+          state->wrapper = t3widget::make_unique<file_write_wrapper_t>(state->staged.get(),
+                                                                       state->conversion_handle);
+          state->i = 0;
+          state->delta_offset = -1;
+          if (state->background) {
+            /* The snapshot only holds the changed lines, so it is taken again. This saves the
+               current text, which may have been changed since the save started. */
+            state->snapshot_generation = change_generation;
+            take_snapshot(state);
+          }
+          rw_result_t result = state->background ? stage_snapshot(state) : stage_lines(state);
+          if (result != rw_result_t::SUCCESS) {
+            return result;
+          }
         }
+      }
+      /* An atomic save writes a new file, and leaves the original untouched until the new file
+         replaces it. This saves copying the original to a backup. Saving only the changed part
+         of the file in place is cheaper still, so an atomic save is only used otherwise. */
+      if (option.atomic_save && state->delta_offset < 0 && !state->original_mode.is_valid() &&
+          prepare_atomic_save(state)) {
+        state->state = save_as_process_t::WRITING;
+      } else if (use_pre_backup(state)) {
+        state->state = save_as_process_t::WRITING;
       } else {
-        if ((idx = temp_name_str.rfind('/')) == std::string::npos) {
-          idx = 0;
+        // If the creation of the backup file fails, the user either aborts or allows continuation
+        // without completing the backup. Thus the next state is always WRITING.
+        state->state = save_as_process_t::WRITING;
+        std::string temp_name_str = state->real_name;
+
+        if (option.make_backup) {
+          temp_name_str += "~";
+          if ((state->backup_fd =
+                   open(temp_name_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0) {
+            return rw_result_t(rw_result_t::BACKUP_FAILED, errno);
+          }
         } else {
-          idx++;
-        }
+          if ((idx = temp_name_str.rfind('/')) == std::string::npos) {
+            idx = 0;
+          } else {
+            idx++;
+          }
 
-        temp_name_str.erase(idx);
-        temp_name_str.append("tilde-backup-XXXXXX");
+          temp_name_str.erase(idx);
+          temp_name_str.append("tilde-backup-XXXXXX");
 
-        /* Unfortunately, we can't pass the c_str result to mkstemp as we are not allowed to change
-           that string. So we'll just have to copy it into a vector :-( */
-        std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
-        // Ensure nul termination.
-        temp_name.push_back(0);
-        if ((state->backup_fd = mkstemp(temp_name.data())) >= 0) {
-          state->temp_name = temp_name.data();
-        } else {
-          return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
-                                             : rw_result_t::BACKUP_FAILED,
-                             errno);
+          /* Unfortunately, we can't pass the c_str result to mkstemp as we are not allowed to
+             change that string. So we'll just have to copy it into a vector :-( */
+          std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+          // Ensure nul termination.
+          temp_name.push_back(0);
+          if ((state->backup_fd = mkstemp(temp_name.data())) >= 0) {
+            state->temp_name = temp_name.data();
+          } else {
+            return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
+                                               : rw_result_t::BACKUP_FAILED,
+                               errno);
+          }
         }
+        /* Only the part of the file that will be overwritten is needed to restore the file. A
+           backup requested by the user is always a complete copy. */
+        state->backup_offset = option.make_backup ? 0 : std::max<off_t>(state->delta_offset, 0);
+        state->state = save_as_process_t::COPY_BACKUP;
       }
-      int error = copy_file(state->fd, state->backup_fd);
-      if (error != 0) {
-        return rw_result_t(
-            errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
-            error);
-      }
-      if (fsync(state->backup_fd) < 0 || close(state->backup_fd) < 0) {
-        return rw_result_t(
-            errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
-            errno);
-      }
-      state->backup_saved = true;
-      state->backup_fd = -1;
+      // After this save, the copy no longer matches the file.
+      pre_backup.reset();
     }
       // FALLTHROUGH
-    case save_as_process_t::WRITING: {
-#ifdef HAS_POSIX_FALLOCATE
-      // Use posix_fallocate to attempt to pre-allocate the required size of the file. If the call
-      // fails with ENOSPC or EFBIG, stop writing and report an error to the user. All other error
-      // codes are ignored.
-      if (posix_fallocate(state->fd, 0, state->computed_length) < 0 &&
-          (errno == ENOSPC || errno == EFBIG)) {
-        // We want the backup to be removed (if it exists), and we didn't change anything, so we
-        // close the file here and set the fd to -1.
-        close(state->fd);
-        state->fd = -1;
-        return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED);
+    case save_as_process_t::COPY_BACKUP:
+      if (state->atomic_name.empty()) {
+        rw_result_t result = run_save_task(state, copy_backup);
+        if (result == rw_result_t::SAVE_IN_PROGRESS) {
+          return result;
+        }
+        state->state = save_as_process_t::WRITING;
+        if (result != rw_result_t::SUCCESS) {
+          return result;
+        }
       }
-#endif
-      int conversion_flags = state->wrapper->conversion_flags();
-      state->wrapper =
-          t3widget::make_unique<file_write_wrapper_t>(state->fd, state->conversion_handle);
-      state->wrapper->add_conversion_flags(conversion_flags);
-      state->i = 0;
-      if (lseek(state->fd, 0, SEEK_SET) < 0) {
-        return rw_result_t(rw_result_t::ERRNO_ERROR);
+      // FALLTHROUGH
+    case save_as_process_t::WRITING: {
+      rw_result_t result = run_save_task(state, write_staged);
+      if (result != rw_result_t::SUCCESS) {
+        // For an atomic save, the original file has not been touched yet.
+        if (!state->atomic_name.empty() && result == rw_result_t::ERRNO_ERROR) {
+          return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, result.get_errno_error());
+        }
+        return result;
       }
-      try {
-        for (; state->i < size(); state->i++) {
-          if (state->i != 0) {
-            state->wrapper->write("\n", 1);
-          }
-          const std::string &data = get_line_data(state->i).get_data();
-          state->wrapper->write(data.data(), data.size());
+      if (!state->atomic_name.empty()) {
+        if (rename(state->atomic_name.c_str(), state->real_name.c_str()) != 0) {
+          return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, errno);
         }
-      } catch (rw_result_t error) {
-        // Don't attempt to retry imprecise conversions, as they should have been caught earlier.
-        // Also, restarting the conversion may append the current line to an already partially
-        // written line.
-        if (error == rw_result_t::CONVERSION_IMPRECISE) {
-          return rw_result_t(rw_result_t::CONVERSION_ERROR);
+        state->atomic_name.clear();
+        /* The file has been saved, so failing to make the rename durable is only logged. The
+           rename is still made durable by the next flush of the file system. */
+        int error = sync_parent_directory(state->real_name, state->durability);
+        if (error != 0) {
+          lprintf("Flushing the directory of %s failed: %s\n", state->real_name.c_str(),
+                  strerror(error));
         }
-        return error;
-      }
-
-      // Truncate it to the written size.
-      int result;
-      while ((result = ftruncate(state->fd, state->wrapper->written_size())) < 0 &&
-             errno == EINTR) {
       }
-      if (result < 0) {
-        return rw_result_t(rw_result_t::ERRNO_ERROR);
+      /* If the buffer was changed while it was saved in the background, the changed lines must be
+         written by the next save, and the buffer still differs from the file. */
+      bool saved_current_text = change_generation == state->snapshot_generation;
+      if (saved_current_text) {
+        first_changed_line = std::numeric_limits<text_pos_t>::max();
       }
-      if (fsync(state->fd) < 0) {
-        return rw_result_t(rw_result_t::ERRNO_ERROR);
+      if (state->durability == save_durability_t::DEFERRED) {
+        // If the file can't be queued, it is simply flushed now.
+        struct stat saved_info;
+        int error;
+        if (fstat(state->fd, &saved_info) == 0) {
+          defer_sync(state->real_name, saved_info.st_dev);
+        } else if ((error = sync_file(state->fd, save_durability_t::FULL)) != 0) {
+          return rw_result_t(rw_result_t::ERRNO_ERROR, error);
+        }
       }
+      record_file_state(state->fd, state->conversion_handle == nullptr &&
+                                       !state->wrapper->normalization_changed());
       /* Perform fchmod instead of chmod on the file name, to ensure that we actually change the
          mode on the file we are interested in. However, we only want to report a problem after
          cleaning up the rest, as it is more of an advisory nature. */
@@ -450,13 +924,19 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
         return rw_result_t(rw_result_t::ERRNO_ERROR);
       }
       state->fd = -1;
+      lprintf("Saved %s from offset %lld using %zu read/write system calls\n",
+              state->real_name.c_str(),
+              static_cast<long long>(std::max<off_t>(state->delta_offset, 0)),
+              state->staged->get_syscalls());
 
       if (!state->name.empty()) {
         name = state->name;
         std::string converted_name = convert_lang_codeset(name, true);
         name_line.set_text(converted_name);
       }
-      set_undo_mark();
+      if (saved_current_text) {
+        set_undo_mark();
+      }
       if (fchmod_errno != 0) {
         return rw_result_t(rw_result_t::MODE_RESET_FAILED, fchmod_errno);
       }
@@ -468,6 +948,305 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
   return rw_result_t(rw_result_t::SUCCESS);
 }
 
+rw_result_t file_buffer_t::stage_lines(save_as_process_t *state) {
+  std::string batch;
+  text_pos_t batch_end = state->i;
+  try {
+    while (state->i < size()) {
+      batch.clear();
+      do {
+        if (batch_end != 0) {
+          batch.push_back('\n');
+        }
+        batch.append(get_line_data(batch_end).get_data());
+        ++batch_end;
+      } while (batch_end < size() && batch.size() < kSaveBatchSize);
+      /* The converted text is staged, to be written once the file has been opened. Conversion
+         errors are caught here, while the file is untouched, and result in asking the user what
+         to do. */
+      state->wrapper->write(batch.data(), batch.size());
+      state->i = batch_end;
+    }
+    state->wrapper->flush();
+  } catch (std::bad_alloc &) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, ENOMEM);
+  } catch (rw_result_t error) {
+    if (error == rw_result_t::CONVERSION_IMPRECISE) {
+      /* The batch has been converted completely, with fallbacks. If the user decides to continue,
+         conversion continues with the next batch. */
+      state->i = batch_end;
+      return error;
+    }
+    return error == rw_result_t::ERRNO_ERROR
+               ? rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, error.get_errno_error())
+               : error;
+  }
+  state->computed_length = state->staged->size();
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+void file_buffer_t::take_snapshot(save_as_process_t *state) {
+  /* The text is copied into a single string, which is cheaper than copying the lines, and allows
+     it to be staged in large batches. Only the lines from state->i are copied, as the lines before
+     it are in the file already. Like stage_lines, the snapshot starts with the separator before
+     line state->i. If there is not enough memory for the copy, the file is saved the normal
+     way. */
+  state->snapshot = std::string();
+  try {
+    size_t snapshot_size = size() - state->i;
+    for (text_pos_t j = state->i; j < size(); ++j) {
+      snapshot_size += get_line_data(j).get_data().size();
+    }
+    state->snapshot.reserve(snapshot_size);
+    for (text_pos_t j = state->i; j < size(); ++j) {
+      if (j != 0) {
+        state->snapshot.push_back('\n');
+      }
+      state->snapshot.append(get_line_data(j).get_data());
+    }
+  } catch (std::bad_alloc &) {
+    state->snapshot = std::string();
+    state->background = false;
+    return;
+  }
+  state->snapshot_offset = 0;
+}
+
+rw_result_t file_buffer_t::run_save_task(save_as_process_t *state,
+                                         rw_result_t (*task)(save_as_process_t *)) {
+  if (!state->background) {
+    return task(state);
+  }
+  if (state->task == nullptr) {
+    try {
+      state->task.reset(new background_task_t([state, task] { return task(state); }));
+    } catch (std::bad_alloc &) {
+      return task(state);
+    } catch (std::system_error &) {
+      // Without a thread, the step is simply done here.
+      return task(state);
+    }
+    return rw_result_t(rw_result_t::SAVE_IN_PROGRESS);
+  }
+  if (!state->task->is_finished()) {
+    return rw_result_t(rw_result_t::SAVE_IN_PROGRESS);
+  }
+  rw_result_t result = state->task->get_result();
+  state->task.reset();
+  return result;
+}
+
+rw_result_t file_buffer_t::stage_snapshot(save_as_process_t *state) {
+  const std::string &text = state->snapshot;
+  size_t batch_end = state->snapshot_offset;
+  try {
+    while (state->snapshot_offset < text.size()) {
+      // Batches end at a line end, such that no character is split.
+      batch_end = text.size();
+      if (batch_end - state->snapshot_offset > kSaveBatchSize) {
+        batch_end = std::min(text.find('\n', state->snapshot_offset + kSaveBatchSize), batch_end);
+      }
+      state->wrapper->write(text.data() + state->snapshot_offset,
+                            batch_end - state->snapshot_offset);
+      state->snapshot_offset = batch_end;
+    }
+    state->wrapper->flush();
+  } catch (std::bad_alloc &) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, ENOMEM);
+  } catch (rw_result_t error) {
+    if (error == rw_result_t::CONVERSION_IMPRECISE) {
+      // See stage_lines.
+      state->snapshot_offset = batch_end;
+      return error;
+    }
+    return error == rw_result_t::ERRNO_ERROR
+               ? rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, error.get_errno_error())
+               : error;
+  }
+  state->computed_length = state->staged->size();
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+#ifdef HAS_XATTR
+/* Copy all extended attributes of @p src_fd to @p dest_fd. This includes the ACLs, which are
+   stored as extended attributes. */
+static bool copy_xattrs(int src_fd, int dest_fd) {
+  ssize_t names_size = flistxattr(src_fd, nullptr, 0);
+  if (names_size <= 0) {
+    return names_size == 0 || errno == ENOTSUP;
+  }
+  std::vector<char> names(names_size);
+  if ((names_size = flistxattr(src_fd, names.data(), names.size())) < 0) {
+    return false;
+  }
+  std::vector<char> value;
+  for (const char *name = names.data(); name < names.data() + names_size;
+       name += strlen(name) + 1) {
+    ssize_t value_size = fgetxattr(src_fd, name, nullptr, 0);
+    if (value_size < 0) {
+      return false;
+    }
+    value.resize(value_size);
+    if ((value_size = fgetxattr(src_fd, name, value.data(), value.size())) < 0 ||
+        fsetxattr(dest_fd, name, value.data(), value_size, 0) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+bool file_buffer_t::prepare_atomic_save(save_as_process_t *state) {
+#ifndef HAS_XATTR
+  /* Without support for extended attributes, the ACLs and other attributes of the original file
+     can not be copied to the new file, so the file is always written in place. */
+  (void)state;
+  return false;
+#else
+  /* Replacing the file would break its hard links. Special files and empty files (such as a file
+     that was just created) are written in place. */
+  struct stat original_info;
+  if (fstat(state->fd, &original_info) != 0 || !S_ISREG(original_info.st_mode) ||
+      original_info.st_nlink != 1 || original_info.st_size == 0) {
+    return false;
+  }
+
+  std::string temp_name_str = state->real_name;
+  size_t idx = temp_name_str.rfind('/');
+  temp_name_str.erase(idx == std::string::npos ? 0 : idx + 1);
+  temp_name_str.append("tilde-save-XXXXXX");
+  std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+  temp_name.push_back(0);
+  int temp_fd = mkstemp(temp_name.data());
+  if (temp_fd < 0) {
+    return false;
+  }
+
+  /* The new file must be indistinguishable from the original for other programs. If the owner,
+     the mode or the extended attributes can not be copied, for example because the file belongs
+     to another user, the file is written in place. The mode is set after the owner, because
+     changing the owner may clear the set-user-ID and set-group-ID bits. */
+  struct stat temp_info;
+  bool prepared =
+      fstat(temp_fd, &temp_info) == 0 &&
+      ((temp_info.st_uid == original_info.st_uid && temp_info.st_gid == original_info.st_gid) ||
+       fchown(temp_fd, original_info.st_uid, original_info.st_gid) == 0) &&
+      fchmod(temp_fd, original_info.st_mode & 07777) == 0 && copy_xattrs(state->fd, temp_fd);
+  if (prepared && option.make_backup) {
+    // The original file becomes the backup, by giving it the backup name as well.
+    std::string backup_name = state->real_name + "~";
+    prepared = (unlink(backup_name.c_str()) == 0 || errno == ENOENT) &&
+               link(state->real_name.c_str(), backup_name.c_str()) == 0;
+  }
+  if (!prepared) {
+    close(temp_fd);
+    unlink(temp_name.data());
+    return false;
+  }
+
+  close(state->fd);
+  state->fd = temp_fd;
+  state->atomic_name = temp_name.data();
+  return true;
+#endif
+}
+
+/* Get the durability with which the backup for a save with @p durability is flushed. The file is
+   overwritten in place after the backup is made, so the backup must be on disk first, even if
+   flushing the file itself is deferred. */
+static save_durability_t get_backup_durability(save_durability_t durability) {
+  return durability == save_durability_t::DEFERRED ? save_durability_t::DATA : durability;
+}
+
+bool file_buffer_t::use_pre_backup(save_as_process_t *state) {
+  struct stat current_info;
+  if (pre_backup == nullptr || !pre_backup->cancel_or_wait() ||
+      pre_backup->get_durability() < get_backup_durability(state->durability) ||
+      fstat(state->fd, &current_info) != 0 || !pre_backup->matches(current_info)) {
+    return false;
+  }
+  std::string snapshot_name = pre_backup->release();
+  if (option.make_backup) {
+    std::string backup_name = state->real_name + "~";
+    if (rename(snapshot_name.c_str(), backup_name.c_str()) != 0) {
+      unlink(snapshot_name.c_str());
+      return false;
+    }
+  } else {
+    state->temp_name = snapshot_name;
+  }
+  state->backup_offset = 0;
+  state->backup_saved = true;
+  return true;
+}
+
+rw_result_t file_buffer_t::copy_backup(save_as_process_t *state) {
+  int error = copy_file_tail(state->fd, state->backup_fd, state->backup_offset);
+  if (error != 0) {
+    return rw_result_t(
+        errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
+        error);
+  }
+  if ((error = sync_file(state->backup_fd, get_backup_durability(state->durability))) != 0) {
+    return rw_result_t(
+        error == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
+        error);
+  }
+  if (close(state->backup_fd) < 0) {
+    return rw_result_t(
+        errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
+        errno);
+  }
+  state->backup_saved = true;
+  state->backup_fd = -1;
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+rw_result_t file_buffer_t::write_staged(save_as_process_t *state) {
+  off_t write_offset = std::max<off_t>(state->delta_offset, 0);
+#ifdef HAS_POSIX_FALLOCATE
+  // Use posix_fallocate to attempt to pre-allocate the required size of the file. If the call
+  // fails with ENOSPC or EFBIG, stop writing and report an error to the user. All other error
+  // codes are ignored.
+  if (posix_fallocate(state->fd, write_offset, state->computed_length) < 0 &&
+      (errno == ENOSPC || errno == EFBIG)) {
+    // We want the backup to be removed (if it exists), and we didn't change anything, so we
+    // close the file here and set the fd to -1.
+    close(state->fd);
+    state->fd = -1;
+    return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED);
+  }
+#endif
+  if (lseek(state->fd, write_offset, SEEK_SET) < 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR);
+  }
+  try {
+    state->staged->write_to(state->fd);
+  } catch (rw_result_t error) {
+    return error;
+  }
+
+  // Truncate it to the written size.
+  int result;
+  while ((result = ftruncate(state->fd, write_offset + state->computed_length)) < 0 &&
+         errno == EINTR) {
+  }
+  if (result < 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR);
+  }
+  /* A file that is renamed over the original must be on disk first. Otherwise, the original may be
+     replaced by an empty file after a crash. */
+  save_durability_t durability = state->durability;
+  if (!state->atomic_name.empty() && durability == save_durability_t::DEFERRED) {
+    durability = save_durability_t::DATA;
+  }
+  int error = sync_file(state->fd, durability);
+  if (error != 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, error);
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
 const std::string &file_buffer_t::get_name() const { return name; }
 
 const char *file_buffer_t::get_encoding() const { return encoding.c_str(); }
@@ -479,18 +1258,72 @@ const edit_window_t::behavior_parameters_t *file_buffer_t::get_behavior_paramete
 }
 
 void file_buffer_t::prepare_paint_line(text_pos_t line) {
-  text_pos_t i;
-
+  plain_line = nullptr;
   if (highlight_info == nullptr || highlight_valid >= line) {
     return;
   }
 
+  /* Once a line is painted without highlighting, so are the lines after it, instead of spending
+     kHighlightStepTime again on every line on the screen. */
+  if (line < first_plain_line &&
+      advance_highlight(line, std::chrono::steady_clock::now() + kHighlightStepTime)) {
+    return;
+  }
+  plain_line = &get_line_data(line);
+  first_plain_line = std::min(first_plain_line, line);
+  if (highlight_target < 0) {
+    // Make continue_highlight run once the user input has been handled.
+    signal_update();
+  }
+  highlight_target = std::max(highlight_target, line);
+}
+
+/* Compute the highlighting start state of the lines up to @p line, each from the end state of the
+   line before it. Lines up to highlight_valid already have a valid start state, so computing
+   continues from there.
+
+   Lines keep their end state as long as they and their start state don't change. After an edit,
+   only the lines from the edit up to the first line whose start state comes out the same are
+   matched again. For the lines after that, the known end states are simply copied.
+   @return Whether @p line was reached before @p deadline. */
+bool file_buffer_t::advance_highlight(text_pos_t line,
+                                      std::chrono::steady_clock::time_point deadline) {
+  bool reached = true;
+  text_pos_t i;
   for (i = highlight_valid >= 0 ? highlight_valid + 1 : 1; i <= line; i++) {
     int state = static_cast<file_line_t *>(get_mutable_line_data(i - 1))->get_highlight_end();
     static_cast<file_line_t *>(get_mutable_line_data(i))->set_highlight_start(state);
+    if (i < line && std::chrono::steady_clock::now() >= deadline) {
+      reached = false;
+      break;
+    }
+  }
+  highlight_valid = std::min(i, line);
+  return reached;
+}
+
+/* Compute the start state of the lines up to @p line without a deadline, for uses other than
+   painting. The lines painted without highlighting are left as they are. */
+void file_buffer_t::complete_highlight(text_pos_t line) {
+  if (highlight_info != nullptr && highlight_valid < line) {
+    advance_highlight(line, std::chrono::steady_clock::time_point::max());
   }
-  highlight_valid = line;
-  match_line = nullptr;
+}
+
+void file_buffer_t::continue_highlight() {
+  if (highlight_target < 0) {
+    return;
+  }
+  // Lines may have been deleted since the target was set.
+  text_pos_t target = std::min(highlight_target, size() - 1);
+  if (highlight_info != nullptr && highlight_valid < target &&
+      !advance_highlight(target, std::chrono::steady_clock::now() + kHighlightStepTime)) {
+    signal_update();
+    return;
+  }
+  first_plain_line = std::numeric_limits<text_pos_t>::max();
+  highlight_target = -1;
+  ++highlight_generation;
 }
 
 void file_buffer_t::set_has_window(bool _has_window) { has_window = _has_window; }
@@ -498,31 +1331,63 @@ void file_buffer_t::set_has_window(bool _has_window) { has_window = _has_window;
 bool file_buffer_t::get_has_window() const { return has_window; }
 
 void file_buffer_t::invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
-  (void)type;
   (void)pos;
+  /* The lines after the changed line are unchanged, but their start state may change. They keep
+     their start and end states, which advance_highlight checks again. */
+  if (type == rewrap_type_t::REWRAP_ALL) {
+    invalidate_line_highlights();
+  } else if (line < size()) {
+    static_cast<file_line_t *>(get_mutable_line_data(line))->invalidate_highlight();
+  }
   if (line <= highlight_valid) {
     highlight_valid = line - 1;
   }
+  plain_line = nullptr;
+}
+
+void file_buffer_t::invalidate_line_highlights() {
+  for (text_pos_t i = 0; i < size(); ++i) {
+    static_cast<file_line_t *>(get_mutable_line_data(i))->invalidate_highlight();
+  }
+}
+
+void file_buffer_t::track_changes(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
+  (void)type;
+  (void)pos;
+  if (appending_file_text) {
+    return;
+  }
+  ++change_generation;
+  if (line < first_changed_line) {
+    first_changed_line = line;
+  }
 }
 
 t3_highlight_t *file_buffer_t::get_highlight() { return highlight_info; }
 
+size_t file_buffer_t::get_highlight_generation() const { return highlight_generation; }
+
 void file_buffer_t::set_highlight(t3_highlight_t *highlight) {
-  if (highlight_info != nullptr) {
-    t3_highlight_free(highlight_info);
-  }
+  release_shared_highlight(highlight_info);
   highlight_info = highlight;
 
-  if (last_match != nullptr) {
-    t3_highlight_free_match(last_match);
-    last_match = nullptr;
+  if (scratch_match != nullptr) {
+    t3_highlight_free_match(scratch_match);
+    scratch_match = nullptr;
   }
 
-  match_line = nullptr;
   highlight_valid = 0;
+  plain_line = nullptr;
+  invalidate_line_highlights();
+  if (highlight_target >= 0) {
+    // The lines painted without highlighting are repainted with the new highlighting.
+    first_plain_line = std::numeric_limits<text_pos_t>::max();
+    highlight_target = -1;
+    ++highlight_generation;
+  }
 
   if (highlight_info != nullptr) {
-    last_match = t3_highlight_new_match(highlight_info);
+    scratch_match = t3_highlight_new_match(highlight_info);
   }
 }
 
@@ -535,6 +1400,14 @@ bool file_buffer_t::get_strip_spaces() const {
 
 void file_buffer_t::set_strip_spaces(bool _strip_spaces) { strip_spaces = _strip_spaces; }
 
+save_durability_t file_buffer_t::get_save_durability() const {
+  return save_durability.value_or(option.save_durability);
+}
+
+void file_buffer_t::set_save_durability(save_durability_t _save_durability) {
+  save_durability = _save_durability;
+}
+
 void file_buffer_t::do_strip_spaces() {
   size_t idx, strip_start;
   bool undo_started = false;
@@ -624,7 +1497,9 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
       return false;
   }
 
-  prepare_paint_line(cursor.line);
+  /* The highlighting decides which braces count, so it must be computed, even if painting the
+     lines would not wait for it. */
+  complete_highlight(cursor.line);
   /* If the current character is highlighted, it is not considered for brace matching. */
   if (line->get_highlight_idx(cursor.pos) > 0) {
     return false;
@@ -641,7 +1516,7 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
 
     for (; current_line < size(); current_line++) {
       line = static_cast<file_line_t *>(get_mutable_line_data(current_line));
-      prepare_paint_line(current_line);
+      complete_highlight(current_line);
       for (i = 0; i < line->size(); i = line->adjust_position(i, 1)) {
       start_search:
         check_c = line->get_data()[i];
@@ -708,7 +1583,7 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
 
       for (current_line--; current_line >= 0; current_line--) {
         line = static_cast<file_line_t *>(get_mutable_line_data(current_line));
-        /* No need to call prepare_paint_line here because we're going backwards. */
+        /* No need to call complete_highlight here because we're going backwards. */
         text_pos_t i;
         for (i = 0, local_count = 0, open_surplus = 0; i < line->size(); i++) {
           check_c = line->get_data()[i];
@@ -14,20 +14,26 @@
 #ifndef FILE_BUFFER_H
 #define FILE_BUFFER_H
 
+#include <chrono>
 #include <memory>
+#include <sys/stat.h>
 
 #include <t3highlight/highlight.h>
 #include <t3widget/widget.h>
 
 using namespace t3widget;
 
+#include "tilde/backupsnapshot.h"
 #include "tilde/filestate.h"
+#include "tilde/lineindex.h"
 
 class file_edit_window_t;
 
 class file_buffer_t : public text_buffer_t {
   friend class file_edit_window_t;  // Required to access behavior_parameters and set_has_window
   friend class file_line_t;
+  friend class load_process_t;     // Required to access load_complete and loader
+  friend class save_as_process_t;  // Required to access saver
 
  private:
   std::string name, encoding;
@@ -35,18 +41,79 @@ class file_buffer_t : public text_buffer_t {
   std::unique_ptr<edit_window_t::behavior_parameters_t> behavior_parameters;
   bool has_window;
   text_pos_t highlight_valid;
+  /* Lines that can not be highlighted within kHighlightStepTime are painted without highlighting,
+     and highlighted on later update notifications instead. first_plain_line is the first line
+     painted that way, and highlight_target the last, or -1 if there are none. plain_line is the
+     line being painted without highlighting. */
+  text_pos_t first_plain_line;
+  text_pos_t highlight_target;
+  const text_line_t *plain_line;
+  // Incremented when the lines painted without highlighting can be painted highlighted.
+  size_t highlight_generation;
+  connection_t highlight_connection;
   optional<bool> strip_spaces;
+  optional<save_durability_t> save_durability;
   t3_highlight_t *highlight_info;
-  const text_line_t *match_line;
-  t3_highlight_match_t *last_match;
+  /* Used by file_line_t to match one whole line at a time. No state is kept in it between calls,
+     which makes all views of the buffer independent: the results are cached per line. */
+  t3_highlight_match_t *scratch_match;
   bool matching_brace_valid;
   text_coordinate_t matching_brace_coordinate;
   std::string line_comment;
+  // Set to false if loading was stopped before the end of the file was reached.
+  bool load_complete;
+  bool load_cancel_requested;
+  int load_progress;
+  // The process loading this file in the background, if any.
+  load_process_t *loader;
+  /* For files of at least option.large_file_size MiB, only a window on the file is loaded. The
+     index of all lines in the file is used to find the start of the window. */
+  std::unique_ptr<line_index_t> line_index;
+  text_pos_t window_first_line;
+  /* The first line changed since the file was last loaded or saved. If file_matches_buffer is
+     set, the file contains exactly the lines before it, and saving only needs to write the rest.
+     file_info identifies the file at that time, to detect changes made by other programs. */
+  text_pos_t first_changed_line;
+  bool file_matches_buffer;
+  struct stat file_info;
+  // Set while text read from the file is appended, which should not count as a change.
+  bool appending_file_text;
+  // Incremented for every change, to find out whether the buffer changed during a save.
+  size_t change_generation;
+  // The process saving this file in the background, if any.
+  save_as_process_t *saver;
+  /* The copy of the file started when it was loaded, if option.pre_backup is set. The first save
+     uses it as its backup if the file has not changed since. */
+  std::unique_ptr<backup_snapshot_t> pre_backup;
 
  private:
   void prepare_paint_line(text_pos_t line) override;
+  rw_result_t open_wrapper(load_process_t *state, const char *wrapper_encoding);
+  rw_result_t load_mapped(load_process_t *state);
+  static size_t get_mapped_file_size(const load_process_t *state);
+  rw_result_t switch_to_wrapper(load_process_t *state);
+  void select_window(load_process_t *state);
+  rw_result_t load_background(load_process_t *state);
+  void append_file_text(string_view text);
+  void append_loaded_text(string_view text);
+  void record_file_state(int fd, bool matches_buffer);
+  void start_pre_backup(int fd);
+  bool use_pre_backup(save_as_process_t *state);
+  rw_result_t stage_lines(save_as_process_t *state);
+  void take_snapshot(save_as_process_t *state);
+  rw_result_t run_save_task(save_as_process_t *state, rw_result_t (*task)(save_as_process_t *));
+  static rw_result_t stage_snapshot(save_as_process_t *state);
+  static bool prepare_atomic_save(save_as_process_t *state);
+  static rw_result_t copy_backup(save_as_process_t *state);
+  static rw_result_t write_staged(save_as_process_t *state);
+  void update_load_progress(off_t done, off_t total);
   void set_has_window(bool _has_window);
+  bool advance_highlight(text_pos_t line, std::chrono::steady_clock::time_point deadline);
+  void complete_highlight(text_pos_t line);
+  void continue_highlight();
   void invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos);
+  void invalidate_line_highlights();
+  void track_changes(rewrap_type_t type, text_pos_t line, text_pos_t pos);
   bool find_matching_brace(text_coordinate_t &match_location);
 
  public:
@@ -55,6 +122,31 @@ class file_buffer_t : public text_buffer_t {
   rw_result_t load(load_process_t *state);
   rw_result_t save(save_as_process_t *state);
 
+  /** Get the progress of loading the file in the background.
+
+      @return The percentage of the file loaded, or -1 if the file is not being loaded.
+  */
+  int get_load_progress() const;
+  /** Check whether the file was loaded completely.
+
+      If the user cancelled loading, or loading was stopped by an error after the file was shown,
+      the buffer contains only part of the file. Such a buffer can not be saved under its own
+      name.
+  */
+  bool is_load_complete() const;
+  /** Stop loading the file in the background, keeping what has been loaded so far. */
+  void cancel_load();
+  /** Check whether the file is being saved in the background. */
+  bool is_saving() const;
+  /** Remove the copy of the file made for the first save, if any, waiting for it if needed. */
+  void discard_pre_backup();
+  /** Get the index of all lines in the file, if only a window on the file is loaded.
+      @return @c nullptr if the whole file is loaded.
+  */
+  const line_index_t *get_line_index() const;
+  /** Get the line number in the file of the first line in the buffer. */
+  text_pos_t get_window_first_line() const;
+
   const std::string &get_name() const;
   const char *get_encoding() const;
   const edit_window_t::behavior_parameters_t *get_behavior_parameters() const;
@@ -63,13 +155,22 @@ class file_buffer_t : public text_buffer_t {
   bool get_has_window() const;
 
   t3_highlight_t *get_highlight();
+  /** Set the highlighting definition, which must be loaded through the functions in
+      highlightcache.h. The buffer takes over the reference to it. */
   void set_highlight(t3_highlight_t *highlight);
+  /** Get a counter that changes when lines that were painted without highlighting, because the
+      highlighting had not reached them yet, should be painted again. */
+  size_t get_highlight_generation() const;
 
   bool get_strip_spaces() const;
   void set_strip_spaces(bool _strip_spaces);
 
   void do_strip_spaces();
 
+  /** Get how this buffer is flushed to disk when it is saved. */
+  save_durability_t get_save_durability() const;
+  void set_save_durability(save_durability_t _save_durability);
+
   bool goto_matching_brace();
   /** Update the matching brace information in the file_buffer_t.
 
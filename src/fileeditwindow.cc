@@ -11,6 +11,8 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+
 #include "tilde/fileeditwindow.h"
 #include "tilde/fileautocompleter.h"
 #include "tilde/main.h"
@@ -41,7 +43,20 @@ void file_edit_window_t::draw_info_window() {
   file_buffer_t *_text = static_cast<file_buffer_t *>(text);
   text_line_t *name_line = _text->get_name_line();
   text_line_t::paint_info_t paint_info;
-  int name_width = info_window.get_width();
+  std::string status;
+
+  shown_load_progress = _text->get_load_progress();
+  if (shown_load_progress >= 0) {
+    printf_into(&status, " [Loading %d%%]", shown_load_progress);
+  } else if (_text->get_line_index() != nullptr) {
+    printf_into(&status, " [Lines %lld-%lld of %lld]",
+                static_cast<long long>(_text->get_window_first_line() + 1),
+                static_cast<long long>(_text->get_window_first_line() + _text->size()),
+                static_cast<long long>(_text->get_line_index()->get_line_count()));
+  } else if (!_text->is_load_complete()) {
+    status = " [Incomplete]";
+  }
+  int name_width = std::max(info_window.get_width() - static_cast<int>(status.size()), 3);
 
   info_window.set_paint(0, 0);
   info_window.set_default_attrs(get_attribute(attribute_t::MENUBAR));
@@ -65,6 +80,7 @@ void file_edit_window_t::draw_info_window() {
   paint_info.selected_attr = 0;
 
   name_line->paint_line(&info_window, paint_info);
+  info_window.addstr(status.c_str(), 0);
   info_window.clrtoeol();
 }
 
@@ -101,6 +117,12 @@ bool file_edit_window_t::process_key(t3widget::key_t key) {
       case EKEY_F2:
         show_character_details();
         return true;
+      case EKEY_ESC:
+        if (get_text()->get_load_progress() >= 0) {
+          get_text()->cancel_load();
+          return true;
+        }
+        break;
       default:
         break;
     }
@@ -129,6 +151,13 @@ void file_edit_window_t::update_contents() {
   if (get_text()->update_matching_brace()) {
     update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
   }
+  if (get_text()->get_load_progress() != shown_load_progress) {
+    draw_info_window();
+  }
+  if (get_text()->get_highlight_generation() != shown_highlight_generation) {
+    shown_highlight_generation = get_text()->get_highlight_generation();
+    update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
+  }
   edit_window_t::update_contents();
 }
 
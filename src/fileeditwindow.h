@@ -22,6 +22,10 @@ using namespace t3widget;
 class file_edit_window_t : public edit_window_t {
  private:
   connection_t rewrap_connection;
+  // The load progress shown in the info window, to redraw it when the progress changes.
+  int shown_load_progress = -1;
+  // The highlight generation of the text when it was last repainted, to repaint when it changes.
+  size_t shown_highlight_generation = 0;
   void force_repaint_to_bottom(rewrap_type_t type, text_pos_t line, text_pos_t pos);
 
  public:
@@ -11,6 +11,8 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+
 #include "tilde/fileline.h"
 #include "tilde/option.h"
 
@@ -18,11 +20,51 @@ static file_line_factory_t default_file_line_factory(nullptr);
 
 file_line_t::file_line_t(int buffersize, file_line_factory_t *_factory)
     : text_line_t(buffersize, _factory == nullptr ? &default_file_line_factory : _factory),
-      highlight_start_state(0) {}
+      highlight_start_state(0),
+      highlight_end_state(-1) {}
 
 file_line_t::file_line_t(string_view _buffer, file_line_factory_t *_factory)
     : text_line_t(_buffer, _factory == nullptr ? &default_file_line_factory : _factory),
-      highlight_start_state(0) {}
+      highlight_start_state(0),
+      highlight_end_state(-1) {}
+
+/* Get the highlighting of the line, computing it if it is not cached. The file_buffer_t must have
+   highlighting. */
+const file_line_t::highlight_spans_t *file_line_t::get_highlight_spans() const {
+  if (highlight_spans != nullptr) {
+    return highlight_spans.get();
+  }
+
+  file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
+  std::unique_ptr<highlight_spans_t> result = t3widget::make_unique<highlight_spans_t>();
+  const std::string &str = get_data();
+  auto add_span = [&result](size_t end, int attribute_idx) {
+    std::vector<highlight_spans_t::span_t> &spans = result->spans;
+    if (spans.empty() || spans.back().attribute_idx != attribute_idx) {
+      spans.push_back({static_cast<text_pos_t>(end), attribute_idx});
+    } else {
+      spans.back().end = static_cast<text_pos_t>(end);
+    }
+  };
+
+  t3_highlight_reset(file->scratch_match, highlight_start_state);
+  bool more;
+  do {
+    more = t3_highlight_match(file->scratch_match, str.data(), str.size());
+    size_t match_start = t3_highlight_get_match_start(file->scratch_match);
+    size_t end = t3_highlight_get_end(file->scratch_match);
+    if (match_start > t3_highlight_get_start(file->scratch_match)) {
+      add_span(match_start, t3_highlight_get_begin_attr(file->scratch_match));
+    }
+    if (end > match_start) {
+      add_span(end, t3_highlight_get_match_attr(file->scratch_match));
+    }
+  } while (more);
+  result->spans.shrink_to_fit();
+  highlight_end_state = t3_highlight_get_state(file->scratch_match);
+  highlight_spans = std::move(result);
+  return highlight_spans.get();
+}
 
 int file_line_t::get_highlight_idx(text_pos_t i) const {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
@@ -31,29 +73,21 @@ int file_line_t::get_highlight_idx(text_pos_t i) const {
     return -1;
   }
 
-  const std::string &str = get_data();
-  if (static_cast<size_t>(i) >= str.size()) {
+  if (static_cast<size_t>(i) >= get_data().size()) {
     return -1;
   }
 
-  if (file->match_line != this ||
-      static_cast<size_t>(i) < t3_highlight_get_start(file->last_match)) {
-    file->match_line = this;
-    t3_highlight_reset(file->last_match, highlight_start_state);
-  }
-
-  while (t3_highlight_get_end(file->last_match) <= static_cast<size_t>(i)) {
-    t3_highlight_match(file->last_match, str.data(), str.size());
-  }
-
-  return static_cast<size_t>(i) < t3_highlight_get_match_start(file->last_match)
-             ? t3_highlight_get_begin_attr(file->last_match)
-             : t3_highlight_get_match_attr(file->last_match);
+  const std::vector<highlight_spans_t::span_t> &spans = get_highlight_spans()->spans;
+  auto span = std::upper_bound(
+      spans.begin(), spans.end(), i,
+      [](text_pos_t pos, const highlight_spans_t::span_t &other) { return pos < other.end; });
+  return span == spans.end() ? -1 : span->attribute_idx;
 }
 
 t3_attr_t file_line_t::get_base_attr(text_pos_t i, const paint_info_t &info) const {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
-  int idx = get_highlight_idx(i);
+  // The start state of a line painted without highlighting is not known yet.
+  int idx = file->plain_line == this ? -1 : get_highlight_idx(i);
   t3_attr_t result = option.highlights.lookup_attributes(idx).value_or(info.normal_attr);
 
   if (file->matching_brace_valid &&
@@ -65,24 +99,34 @@ t3_attr_t file_line_t::get_base_attr(text_pos_t i, const paint_info_t &info) con
   return result;
 }
 
-void file_line_t::set_highlight_start(int state) { highlight_start_state = state; }
+void file_line_t::set_highlight_start(int state) {
+  if (state != highlight_start_state) {
+    highlight_start_state = state;
+    invalidate_highlight();
+  }
+}
+
+void file_line_t::invalidate_highlight() {
+  highlight_spans.reset();
+  highlight_end_state = -1;
+}
 
 int file_line_t::get_highlight_end() {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
   if (file == nullptr || file->highlight_info == nullptr) {
     return 0;
   }
-
-  if (file->match_line != this) {
-    file->match_line = this;
-    t3_highlight_reset(file->last_match, highlight_start_state);
+  if (highlight_end_state >= 0) {
+    return highlight_end_state;
   }
 
   const std::string &str = get_data();
-  while (t3_highlight_match(file->last_match, str.data(), str.size())) {
+  t3_highlight_reset(file->scratch_match, highlight_start_state);
+  while (t3_highlight_match(file->scratch_match, str.data(), str.size())) {
   }
 
-  return t3_highlight_get_state(file->last_match);
+  highlight_end_state = t3_highlight_get_state(file->scratch_match);
+  return highlight_end_state;
 }
 
 //====================== file_line_factory_t ========================
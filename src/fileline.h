@@ -14,7 +14,9 @@
 #ifndef FILE_LINE_H
 #define FILE_LINE_H
 
+#include <memory>
 #include <t3widget/textline.h>
+#include <vector>
 
 #include "tilde/filebuffer.h"
 
@@ -22,7 +24,28 @@ class file_line_factory_t;
 
 class file_line_t : public text_line_t {
  protected:
+  /** The highlighting of a line, as computed from its start state. */
+  struct highlight_spans_t {
+    struct span_t {
+      // The offset just past the end of the span.
+      text_pos_t end;
+      int attribute_idx;
+    };
+    // The spans in increasing order, where the next span starts at the end of the previous one.
+    std::vector<span_t> spans;
+  };
+
   int highlight_start_state;
+  /* The highlighting state at the end of the line, or -1 if it is not known. Like
+     highlight_spans, it is reset when the line or its start state changes. When the text before
+     the line changes, but its start state turns out to be the same, the state at its end is
+     therefore still known, and the lines after it need not be matched again. */
+  mutable int highlight_end_state;
+  /* Computed the first time the highlighting of the line is requested, and reset when the line
+     or its start state changes. */
+  mutable std::unique_ptr<highlight_spans_t> highlight_spans;
+
+  const highlight_spans_t *get_highlight_spans() const;
 
  public:
   file_line_t(int buffersize = BUFFERSIZE, file_line_factory_t *_factory = nullptr);
@@ -31,6 +54,8 @@ class file_line_t : public text_line_t {
   void set_highlight_start(int state);
   int get_highlight_end();
   int get_highlight_idx(text_pos_t i) const;
+  /** Discard the cached highlighting of the line, because the line changed. */
+  void invalidate_highlight();
 
  protected:
   t3_attr_t get_base_attr(text_pos_t i, const paint_info_t &info) const override;
@@ -0,0 +1,126 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <fcntl.h>
+#include <new>
+#include <unistd.h>
+
+#include "tilde/fileprefetcher.h"
+#include "tilde/utf8check.h"
+
+/* Files at least this size are not prefetched. This is the size above which files are loaded in
+   the background. */
+static const off_t kMaxPrefetchSize = 4 * 1024 * 1024;
+/* Maximum number of files mapped ahead of the file being loaded. This limits the memory and the
+   number of mappings used for long file lists. It is well below the number of mappings available
+   to prefetching, see mapped_file_t::create. */
+static const size_t kMaxAhead = 16;
+// The work is I/O bound, so a few threads help even on a single core.
+static const unsigned kMinThreads = 2;
+static const unsigned kMaxThreads = 8;
+
+bool prefetched_file_t::matches(const struct stat &other_info) const {
+  return file_info.st_dev == other_info.st_dev && file_info.st_ino == other_info.st_ino &&
+         file_info.st_size == other_info.st_size &&
+         file_info.st_mtim.tv_sec == other_info.st_mtim.tv_sec &&
+         file_info.st_mtim.tv_nsec == other_info.st_mtim.tv_nsec;
+}
+
+file_prefetcher_t::file_prefetcher_t(std::vector<std::string> _names)
+    : names(std::move(_names)), results(names.size()), done(names.size(), false) {
+  unsigned thread_count =
+      std::max(kMinThreads, std::min(kMaxThreads, std::thread::hardware_concurrency()));
+  thread_count = std::min<size_t>(thread_count, names.size());
+  for (unsigned i = 0; i < thread_count; ++i) {
+    threads.emplace_back(&file_prefetcher_t::run, this);
+  }
+}
+
+file_prefetcher_t::~file_prefetcher_t() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cancelled = true;
+  }
+  changed.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+std::unique_ptr<prefetched_file_t> file_prefetcher_t::take(size_t index) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (index >= names.size()) {
+    return nullptr;
+  }
+  taken = index + 1;
+  if (next_index <= index) {
+    // No worker started on this file. Loading it directly is faster than waiting.
+    next_index = index + 1;
+    lock.unlock();
+    changed.notify_all();
+    return nullptr;
+  }
+  changed.notify_all();
+  changed.wait(lock, [this, index] { return done[index]; });
+  return std::move(results[index]);
+}
+
+void file_prefetcher_t::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!cancelled && next_index < names.size()) {
+    if (next_index >= taken + kMaxAhead) {
+      changed.wait(lock);
+      continue;
+    }
+    size_t index = next_index++;
+    lock.unlock();
+    std::unique_ptr<prefetched_file_t> result;
+    try {
+      result = prefetch(names[index]);
+    } catch (std::bad_alloc &) {
+      // The file will simply be loaded without prefetching.
+    }
+    lock.lock();
+    results[index] = std::move(result);
+    done[index] = true;
+    changed.notify_all();
+  }
+}
+
+std::unique_ptr<prefetched_file_t> file_prefetcher_t::prefetch(const std::string &name) {
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  std::unique_ptr<prefetched_file_t> result(new prefetched_file_t);
+  if (fstat(fd, &result->file_info) < 0 || !S_ISREG(result->file_info.st_mode) ||
+      result->file_info.st_size >= kMaxPrefetchSize) {
+    close(fd);
+    return nullptr;
+  }
+  result->mapping = mapped_file_t::create(fd, true);
+  // The mapping remains valid after closing the file descriptor.
+  close(fd);
+  if (result->mapping == nullptr) {
+    return nullptr;
+  }
+  // This reads all pages of the file.
+  result->valid_utf8 =
+      find_invalid_utf8(result->mapping->data(), result->mapping->size()) == nullptr;
+  // A file that was truncated while it was read is loaded without the prefetched mapping.
+  if (result->mapping->get_intact_size() < result->mapping->size()) {
+    return nullptr;
+  }
+  return result;
+}
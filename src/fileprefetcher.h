@@ -0,0 +1,81 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FILE_PREFETCHER_H
+#define FILE_PREFETCHER_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#include "tilde/filewrapper.h"
+
+/** A file that was mapped and checked by a file_prefetcher_t. */
+struct prefetched_file_t {
+  std::unique_ptr<mapped_file_t> mapping;
+  struct stat file_info;
+  // Whether the whole mapping is valid UTF-8.
+  bool valid_utf8;
+
+  /** Check whether the file described by @p other_info is the file that was prefetched, and has
+      not changed since. */
+  bool matches(const struct stat &other_info) const;
+};
+
+/** Reads a list of files on a pool of worker threads.
+
+    Loading the files given on the command line one after another mostly waits for I/O. The
+    workers map the files ahead of the load_process_t that loads them, which brings them into the
+    page cache and validates them as UTF-8 at the same time. The files are still added to the
+    buffer in order by the load_process_t, so any questions about the files are asked in order as
+    well.
+
+    Large files are skipped, because these are loaded in the background anyway.
+*/
+class file_prefetcher_t {
+ public:
+  explicit file_prefetcher_t(std::vector<std::string> names);
+  /** Stop the worker threads and wait for them to exit. */
+  ~file_prefetcher_t();
+
+  /** Get the result for file number @p index, waiting for it if it is being read.
+
+      This must be called with increasing @p index. Files that no worker has started on yet are
+      no longer prefetched after this call.
+      @return The prefetched file, or @c nullptr if the file was not prefetched.
+  */
+  std::unique_ptr<prefetched_file_t> take(size_t index);
+
+ private:
+  void run();
+  static std::unique_ptr<prefetched_file_t> prefetch(const std::string &name);
+
+  std::vector<std::string> names;
+  std::vector<std::unique_ptr<prefetched_file_t>> results;
+  std::vector<bool> done;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  // The next file a worker should start on, and the first file not yet taken.
+  size_t next_index = 0;
+  size_t taken = 0;
+  bool cancelled = false;
+
+  std::vector<std::thread> threads;
+};
+
+#endif
@@ -12,9 +12,13 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <cstring>
+#include <t3window/terminal.h>
 
+#include "tilde/backgroundreader.h"
+#include "tilde/backgroundtask.h"
 #include "tilde/filebuffer.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightcache.h"
 #include "tilde/log.h"
 #include "tilde/main.h"
 #include "tilde/openfiles.h"
@@ -26,6 +30,16 @@ load_process_t::load_process_t(const callback_t &cb)
       bom_state(UNKNOWN),
       file(nullptr),
       wrapper(nullptr),
+      mapped_offset(0),
+      mapped_start(0),
+      mapped_end(0),
+      mapping_valid(false),
+      window_line(-1),
+      reader(nullptr),
+      file_size(0),
+      background(false),
+      background_pending(false),
+      first_screen_shown(false),
       encoding("UTF-8"),
       fd(-1),
       buffer_used(true) {
@@ -33,12 +47,24 @@ load_process_t::load_process_t(const callback_t &cb)
 }
 
 load_process_t::load_process_t(const callback_t &cb, const char *name, const char *_encoding,
-                               bool missing_ok)
+                               bool missing_ok, text_pos_t _window_line,
+                               std::unique_ptr<prefetched_file_t> _prefetched)
     : stepped_process_t(cb),
       state(missing_ok ? INITIAL_MISSING_OK : INITIAL),
       bom_state(UNKNOWN),
       file(new file_buffer_t(name, _encoding == nullptr ? "UTF-8" : _encoding)),
       wrapper(nullptr),
+      mapped_offset(0),
+      mapped_start(0),
+      mapped_end(0),
+      mapping_valid(false),
+      prefetched(std::move(_prefetched)),
+      window_line(_window_line),
+      reader(nullptr),
+      file_size(0),
+      background(false),
+      background_pending(false),
+      first_screen_shown(false),
       encoding(_encoding == nullptr ? "UTF-8" : _encoding),
       fd(-1),
       buffer_used(true) {
@@ -46,7 +72,16 @@ load_process_t::load_process_t(const callback_t &cb, const char *name, const cha
 }
 
 void load_process_t::set_up_connections() {
-  connections.push_back(continue_abort_dialog->connect_activate([this] { run(); }, 0));
+  /* The dialogs are shared with other processes, which may be started while this process loads a
+     file in the background. Events from the dialogs are therefore ignored while
+     background_pending is set. */
+  connections.push_back(continue_abort_dialog->connect_activate(
+      [this] {
+        if (!background_pending) {
+          run();
+        }
+      },
+      0));
   connections.push_back(continue_abort_dialog->connect_activate([this] { abort(); }, 1));
   connections.push_back(continue_abort_dialog->connect_closed([this] { abort(); }));
 
@@ -60,11 +95,35 @@ void load_process_t::set_up_connections() {
 
   connections.push_back(
       encoding_dialog->connect_activate(bind_front(&load_process_t::encoding_selected, this)));
+
+  connections.push_back(connect_update_notification([this] {
+    if (background_pending) {
+      run();
+    }
+  }));
 }
 
 void load_process_t::abort() {
-  delete file;
+  if (background_pending) {
+    return;
+  }
+  if (file != nullptr && file->get_has_window()) {
+    /* The file is already shown to the user, so it can't be deleted anymore. Keep what was loaded
+       so far, but prevent the partial contents from overwriting the file. */
+    file->load_complete = false;
+    file = nullptr;
+  } else {
+    delete file;
+    file = nullptr;
+  }
+  stepped_process_t::abort();
+}
+
+void load_process_t::abandon_file() {
   file = nullptr;
+  background_pending = false;
+  delete reader;
+  reader = nullptr;
   stepped_process_t::abort();
 }
 
@@ -79,10 +138,35 @@ bool load_process_t::step() {
     return false;
   }
 
+  background_pending = false;
+  file->loader = nullptr;
   switch ((rw_result = file->load(this))) {
     case rw_result_t::SUCCESS:
       result = true;
+      if (wrapper != nullptr) {
+        conversion_stats_t stats = wrapper->get_conversion_stats();
+        if (stats.imprecise > 0 || stats.illegal > 0) {
+          printf_into(&message,
+                      "Conversion from encoding %s substituted %zu characters: %zu irreversibly "
+                      "converted, %zu illegal",
+                      file->get_encoding(), stats.imprecise + stats.illegal, stats.imprecise,
+                      stats.illegal);
+          error_dialog->set_message(message);
+          error_dialog->show();
+        }
+      }
       break;
+    case rw_result_t::LOAD_IN_PROGRESS: {
+      background_pending = true;
+      file->loader = this;
+      int terminal_lines, terminal_columns;
+      t3_term_get_size(&terminal_lines, &terminal_columns);
+      if (first_screen_cb && !first_screen_shown && file->size() > terminal_lines) {
+        first_screen_shown = true;
+        first_screen_cb(this);
+      }
+      return false;
+    }
     case rw_result_t::ERRNO_ERROR:
       printf_into(&message, "Could not load file '%s': %s", file->get_name().c_str(),
                   strerror(rw_result.get_errno_error()));
@@ -101,8 +185,14 @@ bool load_process_t::step() {
     case rw_result_t::CONVERSION_ERROR:
       printf_into(&message, "Could not load file in encoding %s: %s", file->get_encoding(),
                   transcript_strerror(rw_result.get_transcript_error()));
-      delete file;
-      file = nullptr;
+      if (file->get_has_window()) {
+        // See abort() for why the file is kept.
+        file->load_complete = false;
+        result = true;
+      } else {
+        delete file;
+        file = nullptr;
+      }
       error_dialog->set_message(message);
       error_dialog->show();
       break;
@@ -129,12 +219,15 @@ bool load_process_t::step() {
     default:
       PANIC();
   }
-  auto recent_files_iter = recent_files.find(open_files.back()->get_name());
+  if (file == nullptr) {
+    return true;
+  }
+  auto recent_files_iter = recent_files.find(file->get_name());
   if (recent_files_iter != recent_files.end()) {
     if (option.restore_cursor_position) {
       text_coordinate_t position = (*recent_files_iter)->get_position();
-      open_files.back()->goto_pos(position.line + 1, position.pos + 1);
-      open_files.back()->set_top_left_in_behavior_parameters((*recent_files_iter)->get_top_left());
+      file->goto_pos(position.line + 1, position.pos + 1);
+      file->set_top_left_in_behavior_parameters((*recent_files_iter)->get_top_left());
     }
     recent_files.erase(recent_files_iter);
   }
@@ -143,6 +236,9 @@ bool load_process_t::step() {
 
 void load_process_t::file_selected(const std::string &name) {
   open_files_t::iterator iter;
+  if (background_pending) {
+    return;
+  }
   if ((iter = open_files.contains(name.c_str())) != open_files.end()) {
     file = *iter;
     done();
@@ -154,7 +250,11 @@ void load_process_t::file_selected(const std::string &name) {
   run();
 }
 
-void load_process_t::encoding_selected(const std::string *_encoding) { encoding = *_encoding; }
+void load_process_t::encoding_selected(const std::string *_encoding) {
+  if (!background_pending) {
+    encoding = *_encoding;
+  }
+}
 
 file_buffer_t *load_process_t::get_file_buffer() {
   if (result) {
@@ -167,6 +267,8 @@ void load_process_t::cleanup() {
 #ifdef DEBUG
   ASSERT(result || file == nullptr);
 #endif
+  // The reader must be stopped before the wrapper it uses is deleted.
+  delete reader;
   delete wrapper;
   if (fd >= 0) {
     close(fd);
@@ -174,41 +276,83 @@ void load_process_t::cleanup() {
 }
 
 void load_process_t::preserve_bom() {
+  if (background_pending) {
+    return;
+  }
   // FIXME: set encoding accordingly
   bom_state = PRESERVE_BOM;
   run();
 }
 
 void load_process_t::remove_bom() {
+  if (background_pending) {
+    return;
+  }
   bom_state = REMOVE_BOM;
   run();
 }
 
-void load_process_t::execute(const callback_t &cb) { (new load_process_t(cb))->run(); }
+void load_process_t::execute(const callback_t &cb, const callback_t &first_screen_cb) {
+  load_process_t *process = new load_process_t(cb);
+  process->first_screen_cb = first_screen_cb;
+  process->run();
+}
 
 void load_process_t::execute(const callback_t &cb, const char *name, const char *encoding,
-                             bool missing_ok) {
-  (new load_process_t(cb, name, encoding, missing_ok))->run();
+                             bool missing_ok, text_pos_t window_line,
+                             std::unique_ptr<prefetched_file_t> prefetched) {
+  (new load_process_t(cb, name, encoding, missing_ok, window_line, std::move(prefetched)))->run();
 }
 
 save_as_process_t::save_as_process_t(const callback_t &cb, file_buffer_t *_file,
-                                     bool _allow_highlight_change)
+                                     bool _allow_highlight_change, bool _background)
     : stepped_process_t(cb),
       state(SELECT_FILE),
       file(_file),
-      allow_highlight_change(_allow_highlight_change) {
-  connections.push_back(continue_abort_dialog->connect_activate([this] { run(); }, 0));
-  connections.push_back(continue_abort_dialog->connect_activate([this] { abort(); }, 1));
-  connections.push_back(continue_abort_dialog->connect_closed([this] { abort(); }));
+      allow_highlight_change(_allow_highlight_change),
+      background(_background) {
+  /* As for load_process_t, events from the shared dialogs are ignored while the file is saved in
+     the background. */
+  connections.push_back(continue_abort_dialog->connect_activate(
+      [this] {
+        if (!background_pending) {
+          run();
+        }
+      },
+      0));
+  connections.push_back(continue_abort_dialog->connect_activate(
+      [this] {
+        if (!background_pending) {
+          abort();
+        }
+      },
+      1));
+  connections.push_back(continue_abort_dialog->connect_closed([this] {
+    if (!background_pending) {
+      abort();
+    }
+  }));
 
   connections.push_back(
       save_as_dialog->connect_file_selected(bind_front(&save_as_process_t::file_selected, this)));
-  connections.push_back(save_as_dialog->connect_closed([this] { abort(); }));
+  connections.push_back(save_as_dialog->connect_closed([this] {
+    if (!background_pending) {
+      abort();
+    }
+  }));
 
   connections.push_back(
       encoding_dialog->connect_activate(bind_front(&save_as_process_t::encoding_selected, this)));
+
+  connections.push_back(connect_update_notification([this] {
+    if (background_pending) {
+      run();
+    }
+  }));
 }
 
+save_as_process_t::~save_as_process_t() {}
+
 bool save_as_process_t::step() {
   std::string message;
   rw_result_t rw_result;
@@ -220,10 +364,23 @@ bool save_as_process_t::step() {
     return false;
   }
 
+  background_pending = false;
+  if (file->saver == this) {
+    file->saver = nullptr;
+  }
   switch ((rw_result = file->save(this))) {
     case rw_result_t::SUCCESS:
       result = true;
+      if (background) {
+        printf_into(&message, "Saved '%s'", file->get_name().c_str());
+        error_dialog->set_message(message);
+        error_dialog->show();
+      }
       break;
+    case rw_result_t::SAVE_IN_PROGRESS:
+      background_pending = true;
+      file->saver = this;
+      return false;
     case rw_result_t::FILE_EXISTS:
       printf_into(&message, "File '%s' already exists", name.c_str());
       continue_abort_dialog->set_message(message);
@@ -246,7 +403,16 @@ bool save_as_process_t::step() {
             "\n\nThe original file has not been touched. Save the current buffer to another "
             "location to ensure its contents are preserved!");
       } else if (backup_saved) {
-        message.append("\n\nThe original contents of the file can still be retrieved from ");
+        if (backup_offset > 0) {
+          std::string offset_message;
+          printf_into(&offset_message,
+                      "\n\nOnly the file from byte %lld onward was changed. The original "
+                      "contents of that part of the file can still be retrieved from ",
+                      static_cast<long long>(backup_offset));
+          message.append(offset_message);
+        } else {
+          message.append("\n\nThe original contents of the file can still be retrieved from ");
+        }
         // FIXME: the file names probably needs to be converted from some other character set.
         if (!temp_name.empty()) {
           message.append(temp_name);
@@ -279,7 +445,6 @@ bool save_as_process_t::step() {
       if (encoding.empty()) {
         encoding = file->get_encoding();
       }
-      i++;
       printf_into(&message,
                   "Conversion into encoding %s is irreversible\n\nThe loaded buffer will continue "
                   "to hold the original text, but the on-disk version will differ.",
@@ -302,6 +467,23 @@ bool save_as_process_t::step() {
       error_dialog->show();
       abort();
       break;
+    case rw_result_t::ALREADY_SAVING:
+      printf_into(&message,
+                  "The file '%s' is still being saved. Try again once saving has completed.",
+                  file->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      break;
+    case rw_result_t::LOAD_INCOMPLETE:
+      printf_into(&message,
+                  "The file '%s' has not been loaded completely. Saving it would discard the part "
+                  "that was not loaded. Use Save As to save the loaded part to another file.",
+                  file->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      break;
     case rw_result_t::RACE_ON_FILE:
       printf_into(&message,
                   "Opening file '%s' after changing the mode opened a different file. The file was "
@@ -322,19 +504,28 @@ bool save_as_process_t::step() {
 }
 
 void save_as_process_t::file_selected(const std::string &_name) {
+  if (background_pending) {
+    return;
+  }
   name = _name;
   state = INITIAL;
   if (allow_highlight_change) {
     highlight_changed = true;
-    file->set_highlight(t3_highlight_load_by_filename(name.c_str(), map_highlight, nullptr,
-                                                      T3_HIGHLIGHT_UTF8, nullptr));
+    file->set_highlight(
+        load_shared_highlight_by_filename(name.c_str(), T3_HIGHLIGHT_UTF8, nullptr));
   }
   run();
 }
 
-void save_as_process_t::encoding_selected(const std::string *_encoding) { encoding = *_encoding; }
+void save_as_process_t::encoding_selected(const std::string *_encoding) {
+  if (!background_pending) {
+    encoding = *_encoding;
+  }
+}
 
 void save_as_process_t::cleanup() {
+  // The task must be stopped before the file descriptors and the wrapper it uses are released.
+  task.reset();
   if (backup_fd >= 0) {
     close(backup_fd);
   }
@@ -354,26 +545,46 @@ void save_as_process_t::cleanup() {
     // Remove the backup file (not the ~ backup, but the temporary file we may have created).
     unlink(temp_name.c_str());
   }
+  if (!atomic_name.empty()) {
+    // The atomic save failed before the new file replaced the original.
+    unlink(atomic_name.c_str());
+  }
   if (conversion_handle) {
     transcript_close_converter(conversion_handle);
   }
 }
 
-void save_as_process_t::execute(const callback_t &cb, file_buffer_t *_file) {
-  (new save_as_process_t(cb, _file))->run();
+void save_as_process_t::abandon_file() {
+  /* Wait for the task, such that the file is not left partially written by a step that is still
+     running. */
+  task.reset();
+  file = nullptr;
+  background_pending = false;
+  stepped_process_t::abort();
+}
+
+void save_as_process_t::execute(const callback_t &cb, file_buffer_t *_file, bool background) {
+  (new save_as_process_t(cb, _file, true, background))->run();
 }
 
 bool save_as_process_t::get_highlight_changed() const { return highlight_changed; }
 
-save_process_t::save_process_t(const callback_t &cb, file_buffer_t *_file)
-    : save_as_process_t(cb, _file, false) {
+size_t save_as_process_t::get_write_syscalls() const {
+  return staged == nullptr ? 0 : staged->get_syscalls();
+}
+
+save_process_t::save_process_t(const callback_t &cb, file_buffer_t *_file, bool _background,
+                               bool _batch_sync)
+    : save_as_process_t(cb, _file, false, _background) {
+  batch_sync = _batch_sync;
   if (!file->get_name().empty()) {
     state = INITIAL;
   }
 }
 
-void save_process_t::execute(const callback_t &cb, file_buffer_t *_file) {
-  (new save_process_t(cb, _file))->run();
+void save_process_t::execute(const callback_t &cb, file_buffer_t *_file, bool background,
+                             bool batch_sync) {
+  (new save_process_t(cb, _file, background, batch_sync))->run();
 }
 
 close_process_t::close_process_t(const callback_t &cb, file_buffer_t *_file)
@@ -389,6 +600,16 @@ close_process_t::close_process_t(const callback_t &cb, file_buffer_t *_file)
 }
 
 bool close_process_t::step() {
+  if (state >= CONFIRM_CLOSE && file->is_saving()) {
+    std::string message;
+    printf_into(&message,
+                "The file '%s' is still being saved. Try again once saving has completed.",
+                file->get_name().c_str());
+    error_dialog->set_message(message);
+    error_dialog->show();
+    abort();
+    return true;
+  }
   if (state < CONFIRM_CLOSE) {
     if (save_process_t::step()) {
       if (!result) {
@@ -445,6 +666,18 @@ exit_process_t::exit_process_t(const callback_t &cb)
 }
 
 bool exit_process_t::step() {
+  for (file_buffer_t *buffer : open_files) {
+    if (buffer->is_saving()) {
+      std::string message;
+      printf_into(&message,
+                  "The file '%s' is still being saved. Try again once saving has completed.",
+                  buffer->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      return true;
+    }
+  }
   for (; iter != open_files.end(); iter++) {
     if ((*iter)->is_modified()) {
       std::string message;
@@ -484,11 +717,70 @@ void exit_process_t::execute(const callback_t &cb) {
     lprintf("Exit process callback with result %d\n", process->get_result());
     cb(process);
     if (process->get_result()) {
+      // Files saved with deferred durability must be on disk before exiting.
+      int error = flush_deferred_syncs();
+      if (error != 0) {
+        lprintf("Flushing saved files failed: %s\n", strerror(error));
+      }
       exit_main_loop(EXIT_SUCCESS);
     }
   }))->run();
 }
 
+save_all_process_t::save_all_process_t(const callback_t &cb)
+    : stepped_process_t(cb), iter(open_files.begin()) {}
+
+bool save_all_process_t::step() {
+  for (file_buffer_t *buffer : open_files) {
+    if (buffer->is_saving()) {
+      std::string message;
+      printf_into(&message,
+                  "The file '%s' is still being saved. Try again once saving has completed.",
+                  buffer->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      return true;
+    }
+  }
+  for (; iter != open_files.end(); iter++) {
+    if ((*iter)->is_modified()) {
+      save_process_t::execute(bind_front(&save_all_process_t::save_done, this), *iter, false,
+                              true);
+      return false;
+    }
+  }
+
+  /* A single flush for all saved files is much cheaper than flushing every file separately, in
+     particular on file systems where each flush waits for the journal to be committed. */
+  int error = flush_deferred_syncs();
+  if (error != 0) {
+    std::string message;
+    printf_into(&message,
+                "The files were saved, but flushing them to disk failed: %s. The files may not "
+                "survive a system crash.",
+                strerror(error));
+    error_dialog->set_message(message);
+    error_dialog->show();
+  }
+  result = true;
+  return true;
+}
+
+void save_all_process_t::save_done(stepped_process_t *process) {
+  if (process->get_result()) {
+    ++iter;
+    run();
+  } else {
+    /* The files that were saved must still be flushed, also when the user aborted saving the
+       rest. */
+    flush_deferred_syncs();
+    abort();
+  }
+}
+
+void save_all_process_t::execute(const callback_t &cb) { (new save_all_process_t(cb))->run(); }
+
 open_recent_process_t::open_recent_process_t(const callback_t &cb) : load_process_t(cb) {
   connections.push_back(open_recent_dialog->connect_file_selected(
       bind_front(&open_recent_process_t::recent_file_selected, this)));
@@ -504,6 +796,9 @@ bool open_recent_process_t::step() {
 }
 
 void open_recent_process_t::recent_file_selected(recent_file_info_t *_info) {
+  if (background_pending) {
+    return;
+  }
   info = _info;
   file = new file_buffer_t(info->get_name(), info->get_encoding());
   state = INITIAL;
@@ -511,18 +806,24 @@ void open_recent_process_t::recent_file_selected(recent_file_info_t *_info) {
 }
 
 void open_recent_process_t::cleanup() {
+  load_process_t::cleanup();
   if (result) {
     recent_files.erase(info);
   }
 }
 
-void open_recent_process_t::execute(const callback_t &cb) {
-  (new open_recent_process_t(cb))->run();
+void open_recent_process_t::execute(const callback_t &cb, const callback_t &first_screen_cb) {
+  open_recent_process_t *process = new open_recent_process_t(cb);
+  process->first_screen_cb = first_screen_cb;
+  process->run();
 }
 
 load_cli_file_process_t::load_cli_file_process_t(const callback_t &cb)
     : stepped_process_t(cb),
       iter(cli_option.files.begin()),
+      index(0),
+      line(-1),
+      pos(-1),
       in_load(false),
       encoding_selected(false) {}
 
@@ -543,31 +844,41 @@ bool load_cli_file_process_t::step() {
     }
   }
 
-  while (iter != cli_option.files.end()) {
-    text_pos_t line = -1, pos = -1;
-    std::string filename = *iter;
-    if (default_option.parse_file_positions.value_or(true) &&
-        !cli_option.disable_file_position_parsing) {
-      attempt_file_position_parse(&filename, &line, &pos);
+  if (prefetcher == nullptr && cli_option.files.size() > 1) {
+    std::vector<std::string> names;
+    for (const std::string &arg : cli_option.files) {
+      text_pos_t ignored_line, ignored_pos;
+      names.push_back(get_file_name(arg, &ignored_line, &ignored_pos));
     }
+    prefetcher.reset(new file_prefetcher_t(std::move(names)));
+  }
+
+  while (iter != cli_option.files.end()) {
+    std::string filename = get_file_name(*iter, &line, &pos);
 
     in_load = true;
     load_process_t::execute(bind_front(&load_cli_file_process_t::load_done, this), filename.c_str(),
-                            encoding.c_str(), true);
+                            encoding.c_str(), true, line,
+                            prefetcher == nullptr ? nullptr : prefetcher->take(index));
     if (in_load) {
       return false;
     }
-    open_files.back()->goto_pos(line, pos);
   }
   result = true;
   return true;
 }
 
 void load_cli_file_process_t::load_done(stepped_process_t *process) {
-  (void)process;
+  /* Large files are loaded in the background, so the position can only be set once loading is
+     done. */
+  file_buffer_t *file = static_cast<load_process_t *>(process)->get_file_buffer();
+  if (file != nullptr) {
+    file->goto_pos(line > 0 ? line - file->get_window_first_line() : line, pos);
+  }
 
   in_load = false;
   ++iter;
+  ++index;
   if (!in_step) {
     run();
   }
@@ -582,6 +893,18 @@ void load_cli_file_process_t::encoding_selection_done(const std::string *_encodi
   run();
 }
 
+std::string load_cli_file_process_t::get_file_name(const std::string &arg, text_pos_t *_line,
+                                                   text_pos_t *_pos) {
+  std::string filename = arg;
+  *_line = -1;
+  *_pos = -1;
+  if (default_option.parse_file_positions.value_or(true) &&
+      !cli_option.disable_file_position_parsing) {
+    attempt_file_position_parse(&filename, _line, _pos);
+  }
+  return filename;
+}
+
 static bool is_ascii_digit(int c) { return c >= '0' && c <= '9'; }
 
 void load_cli_file_process_t::attempt_file_position_parse(std::string *filename, text_pos_t *line,
@@ -22,58 +22,31 @@
 #include <t3widget/widget.h>
 #include <transcript/transcript.h>
 
+#include "tilde/durability.h"
+#include "tilde/fileprefetcher.h"
 #include "tilde/filewrapper.h"
 #include "tilde/openfiles.h"
 #include "tilde/util.h"
 
 using namespace t3widget;
 
+class background_reader_t;
+class background_task_t;
 class file_buffer_t;
 
-class rw_result_t {
- public:
-  enum stop_reason_t {
-    SUCCESS,
-    FILE_EXISTS,
-    READ_ONLY_FILE,
-    BACKUP_FAILED,
-    ERRNO_ERROR,
-    ERRNO_ERROR_FILE_UNTOUCHED,
-    CONVERSION_OPEN_ERROR,
-    CONVERSION_IMPRECISE,
-    CONVERSION_ERROR,
-    CONVERSION_ILLEGAL,
-    CONVERSION_TRUNCATED,
-    BOM_FOUND,
-    MODE_RESET_FAILED,
-    INTERNAL_ERROR,
-    RACE_ON_FILE,
-  };
-
- private:
-  stop_reason_t reason = SUCCESS;
-  union {
-    int errno_error;
-    transcript_error_t transcript_error;
-  };
-
- public:
-  rw_result_t() = default;
-  explicit rw_result_t(stop_reason_t _reason) : reason(_reason), errno_error(errno) {}
-  rw_result_t(stop_reason_t _reason, int _errno_error)
-      : reason(_reason), errno_error(_errno_error) {}
-  rw_result_t(stop_reason_t _reason, transcript_error_t _transcript_error)
-      : reason(_reason), transcript_error(_transcript_error) {}
-  int get_errno_error() { return errno_error; }
-  transcript_error_t get_transcript_error() { return transcript_error; }
-  operator int() const { return static_cast<int>(reason); }
-};
-
 class load_process_t : public stepped_process_t {
   friend class file_buffer_t;
 
  protected:
-  enum { SELECT_FILE, INITIAL, INITIAL_MISSING_OK, READING_FIRST, READING } state;
+  enum {
+    SELECT_FILE,
+    INITIAL,
+    INITIAL_MISSING_OK,
+    READING_FIRST,
+    READING,
+    READING_MAPPED,
+    READING_BACKGROUND
+  } state;
 
   enum {
     UNKNOWN,
@@ -83,12 +56,30 @@ class load_process_t : public stepped_process_t {
 
   file_buffer_t *file;
   file_read_wrapper_t *wrapper;
+  // For UTF-8 files that can be mapped, the mapping replaces the wrapper.
+  std::unique_ptr<mapped_file_t> mapping;
+  size_t mapped_offset, mapped_start, mapped_end;
+  // Set if the whole mapping is known to be valid UTF-8, such that it need not be checked again.
+  bool mapping_valid;
+  // The file as read by a file_prefetcher_t, if available.
+  std::unique_ptr<prefetched_file_t> prefetched;
+  // For large files, the line (counting from 1) that should be in the loaded window.
+  text_pos_t window_line;
+  // Large files are read by a background_reader_t, such that the UI remains responsive.
+  background_reader_t *reader;
+  off_t file_size;
+  bool background;
+  // Set while waiting for the next update notification to continue a background load.
+  bool background_pending;
+  callback_t first_screen_cb;
+  bool first_screen_shown;
   std::string encoding;
   int fd;
   bool buffer_used;
 
   explicit load_process_t(const callback_t &cb);
-  load_process_t(const callback_t &cb, const char *name, const char *_encoding, bool missing_ok);
+  load_process_t(const callback_t &cb, const char *name, const char *_encoding, bool missing_ok,
+                 text_pos_t _window_line, std::unique_ptr<prefetched_file_t> _prefetched);
   void abort();
   bool step() override;
   virtual void file_selected(const std::string &name);
@@ -96,21 +87,36 @@ class load_process_t : public stepped_process_t {
   void cleanup() override;
   void preserve_bom();
   void remove_bom();
+  /** Stop loading, because the file_buffer_t is being deleted while it is loaded in the
+      background. */
+  void abandon_file();
 
  public:
   void set_up_connections();
 
   virtual file_buffer_t *get_file_buffer();
-  static void execute(const callback_t &cb);
+  /** Load a file selected by the user.
+      @param cb The callback to call when loading is done.
+      @param first_screen_cb If set, the callback to call once the first screenful of a file that
+          is loaded in the background is available. The callback is called before @p cb, which is
+          still called when loading is done.
+  */
+  static void execute(const callback_t &cb, const callback_t &first_screen_cb = nullptr);
+  /** Load the file @p name.
+      @param window_line The line (counting from 1) that must be loaded if the file is so large that
+          only a window on it is loaded, or -1 to load the start of the file.
+      @param prefetched The file as read by a file_prefetcher_t, if available.
+  */
   static void execute(const callback_t &cb, const char *name, const char *encoding = nullptr,
-                      bool missing_ok = false);
+                      bool missing_ok = false, text_pos_t window_line = -1,
+                      std::unique_ptr<prefetched_file_t> prefetched = nullptr);
 };
 
 class save_as_process_t : public stepped_process_t {
   friend class file_buffer_t;
 
  protected:
-  enum { SELECT_FILE, INITIAL, OPEN_FILE, CHANGE_MODE, CREATE_BACKUP, WRITING };
+  enum { SELECT_FILE, INITIAL, OPEN_FILE, CHANGE_MODE, CREATE_BACKUP, COPY_BACKUP, WRITING };
   int state = SELECT_FILE;
 
   file_buffer_t *file;
@@ -134,26 +140,69 @@ class save_as_process_t : public stepped_process_t {
   text_pos_t i;
   transcript_t *conversion_handle = nullptr;
   std::unique_ptr<file_write_wrapper_t> wrapper = nullptr;
-
-  save_as_process_t(const callback_t &cb, file_buffer_t *_file,
-                    bool _allow_highlight_change = true);
+  // The converted contents, which are written to the file once it has been opened.
+  std::unique_ptr<staged_output_t> staged;
+  /* If not negative, only the text from this offset is staged, and it is written from this offset
+     in the file. The temporary backup then only contains the file from this offset. */
+  off_t delta_offset = -1;
+  off_t backup_offset = 0;
+  /* For an atomic save, the name of the temporary file that is written instead of the original,
+     and renamed over it once it is complete. Cleared once it has been renamed. */
+  std::string atomic_name;
+  save_durability_t durability = save_durability_t::FULL;
+  /* Set when the file is saved as one of several files, such that flushing it is deferred to a
+     single flush_deferred_syncs call once all have been written. */
+  bool batch_sync = false;
+
+  /* For a background save, the staging, the backup and the writing are done by a
+     background_task_t, from a copy of the buffer's text made when the save started. The user can
+     continue editing in the mean time. */
+  bool background;
+  // Set while waiting for the next update notification to continue a background save.
+  bool background_pending = false;
+  std::unique_ptr<background_task_t> task;
+  std::string snapshot;
+  // Position in snapshot up to which the text has been staged.
+  size_t snapshot_offset = 0;
+  // The file_buffer_t's change_generation when the text to save was taken from it.
+  size_t snapshot_generation = 0;
+
+  save_as_process_t(const callback_t &cb, file_buffer_t *_file, bool _allow_highlight_change = true,
+                    bool _background = false);
+  ~save_as_process_t() override;
   bool step() override;
   virtual void file_selected(const std::string &_name);
   virtual void encoding_selected(const std::string *_encoding);
   void cleanup() override;
+  /** Stop saving, because the file_buffer_t is being deleted while it is saved in the
+      background. */
+  void abandon_file();
 
  public:
-  static void execute(const callback_t &cb, file_buffer_t *_file);
+  /** Save a file under a name selected by the user.
+      @param background Whether the file may be written in the background, from a copy of the
+          buffer, while the user continues editing.
+  */
+  static void execute(const callback_t &cb, file_buffer_t *_file, bool background = false);
 
   bool get_highlight_changed() const;
+  /** Get the number of system calls used to stage and write the contents of the file. */
+  size_t get_write_syscalls() const;
 };
 
 class save_process_t : public save_as_process_t {
  protected:
-  save_process_t(const callback_t &cb, file_buffer_t *_file);
+  save_process_t(const callback_t &cb, file_buffer_t *_file, bool _background = false,
+                 bool _batch_sync = false);
 
  public:
-  static void execute(const callback_t &cb, file_buffer_t *_file);
+  /** Save a file under its own name, asking for a name if it has none.
+      @param background As for save_as_process_t::execute.
+      @param batch_sync If set, the file is not flushed to disk, but queued for
+          flush_deferred_syncs, unless its durability is save_durability_t::NONE.
+  */
+  static void execute(const callback_t &cb, file_buffer_t *_file, bool background = false,
+                      bool batch_sync = false);
 };
 
 class close_process_t : public save_process_t {
@@ -184,6 +233,19 @@ class exit_process_t : public stepped_process_t {
   static void execute(const callback_t &cb);
 };
 
+/** Saves all modified files, and then flushes them to disk at once. */
+class save_all_process_t : public stepped_process_t {
+ protected:
+  open_files_t::iterator iter;
+
+  explicit save_all_process_t(const callback_t &cb);
+  bool step() override;
+  virtual void save_done(stepped_process_t *process);
+
+ public:
+  static void execute(const callback_t &cb);
+};
+
 class open_recent_process_t : public load_process_t {
  protected:
   recent_file_info_t *info;
@@ -194,7 +256,7 @@ class open_recent_process_t : public load_process_t {
   bool step() override;
 
  public:
-  static void execute(const callback_t &cb);
+  static void execute(const callback_t &cb, const callback_t &first_screen_cb = nullptr);
 };
 
 class load_cli_file_process_t : public stepped_process_t {
@@ -203,10 +265,14 @@ class load_cli_file_process_t : public stepped_process_t {
 
  protected:
   std::list<std::string>::const_iterator iter;
+  size_t index;
+  text_pos_t line, pos;
   bool in_load, encoding_selected;
   std::string encoding;
+  std::unique_ptr<file_prefetcher_t> prefetcher;
 
   explicit load_cli_file_process_t(const callback_t &cb);
+  std::string get_file_name(const std::string &arg, text_pos_t *line, text_pos_t *pos);
   bool step() override;
   virtual void load_done(stepped_process_t *process);
 
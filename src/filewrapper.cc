@@ -11,18 +11,32 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <mutex>
 #include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
 
 #include <t3widget/widget.h>
 #include <uninorm.h>
+#include <unistr.h>
 
 using namespace t3widget;
 
 #include "tilde/filestate.h"
 #include "tilde/filewrapper.h"
+#include "tilde/utf8check.h"
 
-bool read_buffer_t::fill_buffer(int used) {
+bool read_buffer_t::fill_buffer(int used, rw_result_t *event) {
   ssize_t retval;
 
   if (used < fill) {
@@ -33,14 +47,60 @@ bool read_buffer_t::fill_buffer(int used) {
   }
 
   if ((retval = nosig_read(fd, buffer + fill, FILE_BUFFER_SIZE - fill)) < 0) {
-    throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+    *event = rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+    return false;
   }
 
   fill += retval;
   return fill > 0;
 }
 
-bool transcript_buffer_t::fill_buffer(int used) {
+static const int kPermissiveFlags =
+    TRANSCRIPT_ALLOW_FALLBACK | TRANSCRIPT_SUBST_UNASSIGNED | TRANSCRIPT_SUBST_ILLEGAL;
+
+/* Convert as much as possible. The problems that @p flags allow are substituted one at a time, such
+   that they can be counted in @p stats. The first problem that is not allowed stops the
+   conversion. */
+static transcript_error_t convert_counting(transcript_t *handle, const char **inbuf,
+                                           const char *inbuf_end, char **outbuf,
+                                           const char *outbuf_end, int flags,
+                                           conversion_stats_t *stats) {
+  const char *inbuf_start = *inbuf;
+  while (true) {
+    transcript_error_t result = transcript_to_unicode(handle, inbuf, inbuf_end, outbuf, outbuf_end,
+                                                      flags & ~kPermissiveFlags);
+    if (*inbuf > inbuf_start) {
+      flags &= ~TRANSCRIPT_FILE_START;
+    }
+    size_t *counter;
+    switch (result) {
+      case TRANSCRIPT_FALLBACK:
+      case TRANSCRIPT_UNASSIGNED:
+      case TRANSCRIPT_PRIVATE_USE:
+        if (!(flags & TRANSCRIPT_ALLOW_FALLBACK)) {
+          return result;
+        }
+        counter = &stats->imprecise;
+        break;
+      case TRANSCRIPT_ILLEGAL:
+        if (!(flags & TRANSCRIPT_SUBST_ILLEGAL)) {
+          return result;
+        }
+        counter = &stats->illegal;
+        break;
+      default:
+        return result;
+    }
+    result = transcript_to_unicode(handle, inbuf, inbuf_end, outbuf, outbuf_end,
+                                   flags | TRANSCRIPT_SINGLE_CONVERSION);
+    if (result != TRANSCRIPT_SUCCESS) {
+      return result;
+    }
+    ++*counter;
+  }
+}
+
+bool transcript_buffer_t::fill_buffer(int used, rw_result_t *event) {
   const char *inbuf;
   char *outbuf;
   transcript_error_t retval;
@@ -52,8 +112,18 @@ bool transcript_buffer_t::fill_buffer(int used) {
     fill = 0;
   }
 
+  if (pending_event != rw_result_t::SUCCESS) {
+    *event = pending_event;
+    pending_event = rw_result_t();
+    return false;
+  }
+
   if (!at_eof) {  // Don't try to read more bytes when we have already hit EOF
-    if (!wrapped_buffer->fill_buffer(buffer_index)) {
+    if (!wrapped_buffer->fill_buffer(buffer_index, event)) {
+      if (*event != rw_result_t::SUCCESS) {
+        buffer_index = 0;
+        return false;
+      }
       at_eof = true;
       conversion_flags |= TRANSCRIPT_END_OF_TEXT;
     }
@@ -67,9 +137,9 @@ bool transcript_buffer_t::fill_buffer(int used) {
   inbuf = wrapped_buffer->get_buffer() + buffer_index;
   outbuf = buffer + fill;
 
-  retval = transcript_to_unicode(handle, &inbuf,
-                                 wrapped_buffer->get_buffer() + wrapped_buffer->get_fill(), &outbuf,
-                                 buffer + FILE_BUFFER_SIZE, conversion_flags);
+  retval = convert_counting(handle, &inbuf,
+                            wrapped_buffer->get_buffer() + wrapped_buffer->get_fill(), &outbuf,
+                            buffer + FILE_BUFFER_SIZE, conversion_flags, &stats);
   buffer_index = inbuf - wrapped_buffer->get_buffer();
   fill = outbuf - buffer;
 
@@ -77,30 +147,41 @@ bool transcript_buffer_t::fill_buffer(int used) {
     conversion_flags &= ~TRANSCRIPT_FILE_START;
   }
 
+  rw_result_t problem;
   switch (retval) {
     case TRANSCRIPT_SUCCESS:
     case TRANSCRIPT_NO_SPACE:
     case TRANSCRIPT_INCOMPLETE:
-      break;
+      return fill > 0;
 
     case TRANSCRIPT_FALLBACK:
     case TRANSCRIPT_UNASSIGNED:
     case TRANSCRIPT_PRIVATE_USE:
+      // If the user decides to continue, the next problems of this kind are substituted.
       conversion_flags |= TRANSCRIPT_ALLOW_FALLBACK | TRANSCRIPT_SUBST_UNASSIGNED;
-      throw rw_result_t(rw_result_t::CONVERSION_IMPRECISE);
+      problem = rw_result_t(rw_result_t::CONVERSION_IMPRECISE);
+      break;
 
     case TRANSCRIPT_ILLEGAL:
       conversion_flags |= TRANSCRIPT_SUBST_ILLEGAL;
-      throw rw_result_t(rw_result_t::CONVERSION_ILLEGAL);
+      problem = rw_result_t(rw_result_t::CONVERSION_ILLEGAL);
+      break;
 
     case TRANSCRIPT_ILLEGAL_END:
-      throw rw_result_t(rw_result_t::CONVERSION_TRUNCATED);
+      problem = rw_result_t(rw_result_t::CONVERSION_TRUNCATED);
+      break;
 
     case TRANSCRIPT_INTERNAL_ERROR:
     default:
-      throw rw_result_t(rw_result_t::CONVERSION_ERROR);
+      problem = rw_result_t(rw_result_t::CONVERSION_ERROR);
+      break;
   }
-  return fill > 0;
+  if (fill > 0) {
+    pending_event = problem;
+    return true;
+  }
+  *event = problem;
+  return false;
 }
 
 transcript_buffer_t::~transcript_buffer_t() {
@@ -108,7 +189,247 @@ transcript_buffer_t::~transcript_buffer_t() {
   delete wrapped_buffer;
 }
 
-file_read_wrapper_t::file_read_wrapper_t(int fd, transcript_t *handle) {
+/* Chunks are cut at the first newline after this many bytes of input. */
+static const size_t kParallelChunkSize = 1024 * 1024;
+
+parallel_transcript_buffer_t::parallel_transcript_buffer_t(int _fd, transcript_t *_handle,
+                                                           const char *_encoding, size_t threads)
+    : fd(_fd),
+      handle(_handle),
+      encoding(_encoding),
+      conversion_flags(TRANSCRIPT_ALLOW_PRIVATE_USE),
+      max_in_flight(std::max<size_t>(threads, 1)) {}
+
+parallel_transcript_buffer_t::~parallel_transcript_buffer_t() {
+  // Wait for the running conversions, as they use the encoding member.
+  for (std::future<std::unique_ptr<chunk_t>> &chunk : in_flight) {
+    chunk.wait();
+  }
+  transcript_close_converter(handle);
+}
+
+const char *parallel_transcript_buffer_t::get_buffer() {
+  return current == nullptr ? buffer : current->output.data() + current_pos;
+}
+
+int parallel_transcript_buffer_t::get_fill() const {
+  return current == nullptr ? 0 : static_cast<int>(current->output.size() - current_pos);
+}
+
+char parallel_transcript_buffer_t::operator[](int idx) const {
+  return current->output[current_pos + idx];
+}
+
+bool parallel_transcript_buffer_t::fill_buffer(int used, rw_result_t *event) {
+  current_pos += used;
+  while (current == nullptr || current_pos >= current->output.size()) {
+    if (pending_event != rw_result_t::SUCCESS) {
+      *event = pending_event;
+      pending_event = rw_result_t();
+      return false;
+    }
+    if (resume_pending) {
+      /* The conversion of the current chunk stopped at a problem. Now that the user has decided
+         how to handle it, convert the rest of the chunk with the updated flags. */
+      resume_pending = false;
+      std::unique_ptr<chunk_t> rest(new chunk_t);
+      rest->input = current->input.substr(current->converted);
+      rest->flags = conversion_flags | (current->flags & TRANSCRIPT_END_OF_TEXT);
+      if (current->converted == 0) {
+        rest->flags |= current->flags & TRANSCRIPT_FILE_START;
+      }
+      transcript_to_unicode_reset(handle);
+      convert(handle, rest.get());
+      set_current(std::move(rest));
+      continue;
+    }
+
+    start_conversions();
+    if (in_flight.empty()) {
+      current.reset();
+      current_pos = 0;
+      if (read_result != rw_result_t::SUCCESS) {
+        *event = read_result;
+        read_result = rw_result_t();
+      }
+      return false;
+    }
+    std::unique_ptr<chunk_t> chunk = in_flight.front().get();
+    in_flight.pop_front();
+    start_conversions();
+    set_current(std::move(chunk));
+  }
+  return true;
+}
+
+bool parallel_transcript_buffer_t::read_chunk(std::string *input) {
+  input->swap(next_input);
+  next_input.clear();
+  while (true) {
+    size_t old_size = input->size();
+    input->resize(old_size + kParallelChunkSize);
+    ssize_t retval = nosig_read(fd, &(*input)[old_size], kParallelChunkSize);
+    if (retval < 0) {
+      read_result = rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+      return false;
+    }
+    input->resize(old_size + retval);
+    if (retval == 0) {
+      at_eof = true;
+      return true;
+    }
+    const char *newline =
+        static_cast<const char *>(memrchr(input->data() + old_size, '\n', retval));
+    if (newline != nullptr) {
+      size_t chunk_size = newline - input->data() + 1;
+      next_input.assign(*input, chunk_size, std::string::npos);
+      input->resize(chunk_size);
+      return true;
+    }
+  }
+}
+
+void parallel_transcript_buffer_t::start_conversions() {
+  while (!all_started && in_flight.size() < max_in_flight) {
+    std::unique_ptr<chunk_t> chunk(new chunk_t);
+    if (!read_chunk(&chunk->input)) {
+      // The error is reported once the chunks before it have been used.
+      all_started = true;
+      return;
+    }
+    chunk->flags = conversion_flags;
+    if (first_chunk) {
+      chunk->flags |= TRANSCRIPT_FILE_START;
+      first_chunk = false;
+    }
+    if (at_eof) {
+      chunk->flags |= TRANSCRIPT_END_OF_TEXT;
+      all_started = true;
+    }
+    /* Allowing a deferred launch makes std::async run the conversion in this thread if no new
+       thread can be started. */
+    in_flight.push_back(std::async(std::launch::async | std::launch::deferred,
+                                   convert_with_new_handle, std::cref(encoding), chunk.release()));
+  }
+}
+
+void parallel_transcript_buffer_t::set_current(std::unique_ptr<chunk_t> chunk) {
+  current = std::move(chunk);
+  current_pos = 0;
+  stats.imprecise += current->stats.imprecise;
+  stats.illegal += current->stats.illegal;
+
+  /* The chunk may have been converted before the user allowed a particular kind of problem. In
+     that case the rest of the chunk is simply converted again with the current flags. Otherwise
+     the problem is reported, after the text before it has been passed on. */
+  rw_result_t problem;
+  switch (current->result) {
+    case TRANSCRIPT_SUCCESS:
+    case TRANSCRIPT_INCOMPLETE:
+      break;
+
+    case TRANSCRIPT_FALLBACK:
+    case TRANSCRIPT_UNASSIGNED:
+    case TRANSCRIPT_PRIVATE_USE:
+      resume_pending = true;
+      if (!(conversion_flags & TRANSCRIPT_ALLOW_FALLBACK)) {
+        conversion_flags |= TRANSCRIPT_ALLOW_FALLBACK | TRANSCRIPT_SUBST_UNASSIGNED;
+        problem = rw_result_t(rw_result_t::CONVERSION_IMPRECISE);
+      }
+      break;
+
+    case TRANSCRIPT_ILLEGAL:
+      resume_pending = true;
+      if (!(conversion_flags & TRANSCRIPT_SUBST_ILLEGAL)) {
+        conversion_flags |= TRANSCRIPT_SUBST_ILLEGAL;
+        problem = rw_result_t(rw_result_t::CONVERSION_ILLEGAL);
+      }
+      break;
+
+    case TRANSCRIPT_ILLEGAL_END:
+      problem = rw_result_t(rw_result_t::CONVERSION_TRUNCATED);
+      break;
+
+    case TRANSCRIPT_INTERNAL_ERROR:
+    default:
+      problem = rw_result_t(rw_result_t::CONVERSION_ERROR);
+      break;
+  }
+  pending_event = problem;
+}
+
+void parallel_transcript_buffer_t::convert(transcript_t *handle, chunk_t *chunk) {
+  char output[65536];
+  const char *inbuf = chunk->input.data();
+  const char *inbuf_end = inbuf + chunk->input.size();
+
+  do {
+    char *outbuf = output;
+    chunk->result = convert_counting(handle, &inbuf, inbuf_end, &outbuf, output + sizeof(output),
+                                     chunk->flags, &chunk->stats);
+    chunk->output.append(output, outbuf - output);
+    if (inbuf > chunk->input.data()) {
+      chunk->flags &= ~TRANSCRIPT_FILE_START;
+    }
+  } while (chunk->result == TRANSCRIPT_NO_SPACE);
+  chunk->converted = inbuf - chunk->input.data();
+}
+
+std::unique_ptr<parallel_transcript_buffer_t::chunk_t>
+parallel_transcript_buffer_t::convert_with_new_handle(const std::string &encoding,
+                                                      chunk_t *_chunk) {
+  std::unique_ptr<chunk_t> chunk(_chunk);
+  transcript_error_t error;
+
+  transcript_t *chunk_handle =
+      transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8, 0, &error);
+  if (chunk_handle == nullptr) {
+    chunk->result = TRANSCRIPT_INTERNAL_ERROR;
+    return chunk;
+  }
+  try {
+    convert(chunk_handle, chunk.get());
+  } catch (...) {
+    transcript_close_converter(chunk_handle);
+    throw;
+  }
+  transcript_close_converter(chunk_handle);
+  return chunk;
+}
+
+bool parallel_transcript_buffer_t::is_supported(const char *encoding) {
+  /* Encodings without shift states, in which the byte 0x0A can not be part of a multi-byte
+     character. */
+  static const char *const supported[] = {
+      "ASCII",        "ISO-8859-1",   "ISO-8859-2",   "ISO-8859-3",   "ISO-8859-4",
+      "ISO-8859-5",   "ISO-8859-6",   "ISO-8859-7",   "ISO-8859-8",   "ISO-8859-9",
+      "ISO-8859-10",  "ISO-8859-11",  "ISO-8859-13",  "ISO-8859-14",  "ISO-8859-15",
+      "ISO-8859-16",  "WINDOWS-874",  "WINDOWS-1250", "WINDOWS-1251", "WINDOWS-1252",
+      "WINDOWS-1253", "WINDOWS-1254", "WINDOWS-1255", "WINDOWS-1256", "WINDOWS-1257",
+      "WINDOWS-1258", "IBM437",       "IBM850",       "KOI8-R",       "KOI8-U",
+      "MACINTOSH",    "SHIFT_JIS",    "WINDOWS-31J",  "EUC-JP",       "EUC-KR",
+      "EUC-TW",       "GBK",          "GB18030",      "BIG5",         "BIG5-HKSCS",
+      "WINDOWS-936",  "WINDOWS-949",  "WINDOWS-950",
+  };
+
+  if (std::thread::hardware_concurrency() < 2) {
+    return false;
+  }
+  for (const char *name : supported) {
+    if (transcript_equal(encoding, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+file_read_wrapper_t::file_read_wrapper_t(int fd, transcript_t *handle,
+                                         const char *parallel_encoding) {
+  if (handle != nullptr && parallel_encoding != nullptr) {
+    buffer = new parallel_transcript_buffer_t(fd, handle, parallel_encoding,
+                                              std::thread::hardware_concurrency());
+    return;
+  }
   buffer = new read_buffer_t(fd);
   if (handle != nullptr) {
     buffer_t *transcript_buffer = new transcript_buffer_t(buffer, handle);
@@ -122,31 +443,260 @@ const char *file_read_wrapper_t::get_buffer() { return buffer->get_buffer(); }
 
 int file_read_wrapper_t::get_fill() { return buffer->get_fill(); }
 
-bool file_read_wrapper_t::fill_buffer(int used) { return buffer->fill_buffer(used); }
+bool file_read_wrapper_t::fill_buffer(int used, rw_result_t *event) {
+  return buffer->fill_buffer(used, event);
+}
+
+conversion_stats_t file_read_wrapper_t::get_conversion_stats() const {
+  return buffer->get_conversion_stats();
+}
+
+namespace {
+
+/* The address ranges of the existing mappings, for handle_sigbus. The handler can't take locks or
+   allocate memory, so the slots are a fixed array of atomic values. A slot is free if its start
+   is 0. While a slot is filled in or released, its end is 0, such that the range it covers is
+   empty. */
+struct mapping_slot_t {
+  std::atomic<uintptr_t> start;
+  std::atomic<uintptr_t> end;
+  // The offset of the first page that was replaced, or the size of the mapping if there is none.
+  std::atomic<size_t> intact_size;
+};
+const int kMaxMappings = 64;
+/* The first slots are only used by mappings of files that are being loaded, such that prefetched
+   files can't take all slots. */
+const int kLoadOnlyMappings = 16;
+mapping_slot_t mapping_slots[kMaxMappings];
+uintptr_t page_mask;
+struct sigaction previous_sigbus_action;
+std::once_flag sigbus_handler_installed;
+
+/* Reading a page of a mapping that lies beyond the end of the file raises SIGBUS. If the page is
+   part of one of the mappings, the rest of the mapping is replaced by anonymous pages filled with
+   zeroes, such that the read that caused the signal can be completed when the handler returns. */
+void handle_sigbus(int sig, siginfo_t *info, void *context) {
+  (void)context;
+  uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+  for (mapping_slot_t &slot : mapping_slots) {
+    uintptr_t start = slot.start.load();
+    uintptr_t end = slot.end.load();
+    // If the start changed, the end may belong to another mapping that reused the slot.
+    if (start == 0 || address < start || address >= end || slot.start.load() != start) {
+      continue;
+    }
+    uintptr_t page = address & page_mask;
+    if (mmap(reinterpret_cast<void *>(page), end - page, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      break;
+    }
+    size_t offset = page - start;
+    size_t intact_size = slot.intact_size.load();
+    while (offset < intact_size && !slot.intact_size.compare_exchange_weak(intact_size, offset)) {
+    }
+    return;
+  }
+  // The signal was not caused by a truncated file, so it is handled as it would be without tilde.
+  sigaction(sig, &previous_sigbus_action, nullptr);
+  raise(sig);
+}
+
+void install_sigbus_handler() {
+  page_mask = ~static_cast<uintptr_t>(sysconf(_SC_PAGESIZE) - 1);
+  struct sigaction sa;
+  sa.sa_sigaction = handle_sigbus;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGBUS, &sa, &previous_sigbus_action);
+}
+
+/* Claim a slot for the mapping of @p size bytes at @p data. If @p prefetch is set, the slots
+   reserved for loading are not used.
+   @return The index of the slot, or -1 if there are no free slots. */
+int claim_mapping_slot(const void *data, size_t size, bool prefetch) {
+  std::call_once(sigbus_handler_installed, install_sigbus_handler);
+  uintptr_t start = reinterpret_cast<uintptr_t>(data);
+  for (int i = prefetch ? kLoadOnlyMappings : 0; i < kMaxMappings; ++i) {
+    uintptr_t expected = 0;
+    // The end is still 0, so the handler ignores the slot until the end is stored.
+    if (mapping_slots[i].start.compare_exchange_strong(expected, 1)) {
+      mapping_slots[i].intact_size.store(size);
+      mapping_slots[i].start.store(start);
+      mapping_slots[i].end.store((start + size + ~page_mask) & page_mask);
+      return i;
+    }
+  }
+  return -1;
+}
+
+}  // namespace
+
+std::unique_ptr<mapped_file_t> mapped_file_t::create(int fd, bool prefetch) {
+  struct stat file_info;
+
+  if (fstat(fd, &file_info) < 0 || !S_ISREG(file_info.st_mode) || file_info.st_size == 0) {
+    return nullptr;
+  }
+  // Files that don't fit in the address space (only relevant for 32-bit platforms) use the regular
+  // read path.
+  if (static_cast<uintmax_t>(file_info.st_size) > std::numeric_limits<size_t>::max()) {
+    return nullptr;
+  }
+
+  size_t size = file_info.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  // Without a slot, a file that is truncated while it is mapped would crash the program.
+  int slot = claim_mapping_slot(data, size, prefetch);
+  if (slot < 0) {
+    munmap(data, size);
+    return nullptr;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  return std::unique_ptr<mapped_file_t>(
+      new mapped_file_t(static_cast<const char *>(data), size, slot, file_info));
+}
+
+mapped_file_t::~mapped_file_t() {
+  /* Only the thread that owns the mapping reads it, so no handler can be replacing its pages
+     while it is unmapped. */
+  mapping_slots[slot_].end.store(0);
+  mapping_slots[slot_].start.store(0);
+  munmap(const_cast<char *>(data_), size_);
+}
+
+size_t mapped_file_t::get_intact_size() const {
+  return mapping_slots[slot_].intact_size.load();
+}
+
+file_write_wrapper_t::~file_write_wrapper_t() {
+  if (normalizer_ != nullptr) {
+    uninorm_filter_free(normalizer_);
+  }
+}
 
 void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
-  std::unique_ptr<char, free_deleter> nfc_output;
-  size_t nfc_output_len;
+  const char *end = buffer + bytes;
+
+  while (buffer < end) {
+    size_t ascii = ascii_prefix_length(buffer, end - buffer);
+    if (ascii > 0) {
+      // ASCII characters never combine with the characters before them.
+      flush_normalizer();
+      release_held_ascii();
+      convert(buffer, ascii - 1);
+      held_ascii_ = static_cast<unsigned char>(buffer[ascii - 1]);
+      buffer += ascii;
+      continue;
+    }
+
+    const char *run_end = buffer;
+    while (run_end < end && (*run_end & 0x80)) {
+      run_end++;
+    }
+    normalize(buffer, run_end - buffer);
+    buffer = run_end;
+  }
 
+  if (imprecise_) {
+    imprecise_ = false;
+    throw rw_result_t(rw_result_t::CONVERSION_IMPRECISE);
+  }
+}
+
+void file_write_wrapper_t::normalize(const char *buffer, size_t bytes) {
+  if (normalizer_ == nullptr) {
+    normalizer_ = uninorm_filter_create(UNINORM_NFC, add_normalized, this);
+    if (normalizer_ == nullptr) {
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+    }
+  }
+  normalizer_pending_ = true;
+  if (held_ascii_ >= 0) {
+    int c = held_ascii_;
+    held_ascii_ = -1;
+    normalizer_input_.push_back(static_cast<char>(c));
+    if (uninorm_filter_write(normalizer_, c) < 0) {
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+    }
+  }
+
+  normalizer_input_.append(buffer, bytes);
+  const uint8_t *ptr = reinterpret_cast<const uint8_t *>(buffer);
+  const uint8_t *end = ptr + bytes;
+  while (ptr < end) {
+    ucs4_t c;
+    ptr += u8_mbtouc(&c, ptr, end - ptr);
+    if (uninorm_filter_write(normalizer_, c) < 0) {
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+    }
+  }
+  // The characters produced by the normalizer so far are final.
+  convert(normalized_.data(), normalized_.size());
+  normalized_.clear();
+}
+
+void file_write_wrapper_t::flush_normalizer() {
+  if (!normalizer_pending_) {
+    return;
+  }
+  normalizer_pending_ = false;
+  if (uninorm_filter_flush(normalizer_) < 0) {
+    throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+  if (normalizer_matched_ != normalizer_input_.size()) {
+    normalization_changed_ = true;
+  }
+  normalizer_input_.clear();
+  normalizer_matched_ = 0;
+  convert(normalized_.data(), normalized_.size());
+  normalized_.clear();
+}
+
+void file_write_wrapper_t::release_held_ascii() {
+  if (held_ascii_ >= 0) {
+    char c = static_cast<char>(held_ascii_);
+    held_ascii_ = -1;
+    convert(&c, 1);
+  }
+}
+
+int file_write_wrapper_t::add_normalized(void *data, uint32_t c) {
+  file_write_wrapper_t *wrapper = static_cast<file_write_wrapper_t *>(data);
+  uint8_t encoded[6];
+  int length = u8_uctomb(encoded, c, sizeof(encoded));
+  if (length < 0) {
+    return -1;
+  }
+  if (!wrapper->normalization_changed_) {
+    if (wrapper->normalizer_input_.compare(wrapper->normalizer_matched_, length,
+                                           reinterpret_cast<char *>(encoded), length) == 0) {
+      wrapper->normalizer_matched_ += length;
+    } else {
+      wrapper->normalization_changed_ = true;
+    }
+  }
+  try {
+    wrapper->normalized_.append(reinterpret_cast<char *>(encoded), length);
+  } catch (std::bad_alloc &) {
+    return -1;
+  }
+  return 0;
+}
+
+void file_write_wrapper_t::convert(const char *buffer, size_t bytes) {
   char transcript_buffer[FILE_BUFFER_SIZE], *transcript_buffer_ptr;
   const char *buffer_end, *transcript_buffer_end;
-  bool imprecise = false;
 
-  // Convert to NFC before writing
-  // FIXME: check return value
-  nfc_output.reset(reinterpret_cast<char *>(u8_normalize(
-      UNINORM_NFC, reinterpret_cast<const uint8_t *>(buffer), bytes, nullptr, &nfc_output_len)));
   if (handle_ == nullptr) {
-    if (fd_ >= 0 && nosig_write(fd_, nfc_output.get(), nfc_output_len) < 0) {
-      throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
-    }
-    written_size_ += nfc_output_len;
+    output(buffer, bytes);
     return;
   }
 
   transcript_buffer_end = transcript_buffer + FILE_BUFFER_SIZE;
-  buffer = nfc_output.get();
-  buffer_end = nfc_output.get() + nfc_output_len;
+  buffer_end = buffer + bytes;
 
   while (buffer < buffer_end) {
     transcript_buffer_ptr = transcript_buffer;
@@ -159,7 +709,7 @@ void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
         break;
       case TRANSCRIPT_FALLBACK:
       case TRANSCRIPT_UNASSIGNED:
-        imprecise = true;
+        imprecise_ = true;
         conversion_flags_ |= TRANSCRIPT_ALLOW_FALLBACK | TRANSCRIPT_SUBST_UNASSIGNED;
         break;
       case TRANSCRIPT_INCOMPLETE:
@@ -169,15 +719,162 @@ void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
     }
     if (transcript_buffer_ptr > transcript_buffer) {
       conversion_flags_ &= ~TRANSCRIPT_FILE_START;
-      if (fd_ >= 0 &&
-          nosig_write(fd_, transcript_buffer, transcript_buffer_ptr - transcript_buffer) < 0) {
-        throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
-      }
-      written_size_ += transcript_buffer_ptr - transcript_buffer;
+      output(transcript_buffer, transcript_buffer_ptr - transcript_buffer);
     }
   }
+}
 
-  if (imprecise) {
+void file_write_wrapper_t::output(const char *buffer, size_t bytes) {
+  if (staged_ != nullptr) {
+    staged_->append(buffer, bytes);
+  } else if (writer_ != nullptr) {
+    writer_->write(buffer, bytes);
+  }
+  written_size_ += bytes;
+}
+
+void file_write_wrapper_t::flush() {
+  flush_normalizer();
+  release_held_ascii();
+  if (writer_ != nullptr) {
+    writer_->flush();
+  }
+  if (imprecise_) {
+    imprecise_ = false;
     throw rw_result_t(rw_result_t::CONVERSION_IMPRECISE);
   }
 }
+
+// Size of the buffer of a buffered_writer_t, and of the pieces in which staged output is copied.
+static const size_t kWriteBufferSize = 1024 * 1024;
+
+buffered_writer_t::buffered_writer_t(int fd, size_t *syscalls)
+    : fd_(fd), buffer_(new char[kWriteBufferSize]), syscalls_(syscalls) {}
+
+void buffered_writer_t::write(const char *buffer, size_t bytes) {
+  if (fill_ + bytes <= kWriteBufferSize) {
+    memcpy(buffer_.get() + fill_, buffer, bytes);
+    fill_ += bytes;
+    return;
+  }
+  if (bytes < kWriteBufferSize) {
+    flush();
+    memcpy(buffer_.get(), buffer, bytes);
+    fill_ = bytes;
+    return;
+  }
+  struct iovec iov[2];
+  iov[0].iov_base = buffer_.get();
+  iov[0].iov_len = fill_;
+  iov[1].iov_base = const_cast<char *>(buffer);
+  iov[1].iov_len = bytes;
+  write_vector(iov, 2);
+  fill_ = 0;
+}
+
+void buffered_writer_t::flush() {
+  if (fill_ == 0) {
+    return;
+  }
+  struct iovec iov;
+  iov.iov_base = buffer_.get();
+  iov.iov_len = fill_;
+  write_vector(&iov, 1);
+  fill_ = 0;
+}
+
+void buffered_writer_t::write_vector(struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t result = writev(fd_, iov, count);
+    ++*syscalls_;
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+    }
+    // Skip the parts that were written completely, and continue with the rest after a short write.
+    size_t written = result;
+    while (count > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+/* Outputs larger than this are moved from memory to a temporary file, to avoid doubling the memory
+   used for large buffers. */
+static const size_t kMaxStagedMemory = 16 * 1024 * 1024;
+
+staged_output_t::~staged_output_t() {
+  if (temp_fd_ >= 0) {
+    close(temp_fd_);
+  }
+}
+
+void staged_output_t::append(const char *buffer, size_t bytes) {
+  if (temp_fd_ < 0 && memory_.size() + bytes > kMaxStagedMemory) {
+    spill();
+  }
+  if (temp_fd_ >= 0) {
+    temp_writer_->write(buffer, bytes);
+  } else {
+    try {
+      memory_.append(buffer, bytes);
+    } catch (std::bad_alloc &) {
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+    }
+  }
+  size_ += bytes;
+}
+
+void staged_output_t::spill() {
+  const char *tmpdir = getenv("TMPDIR");
+  std::string temp_name = tmpdir != nullptr && tmpdir[0] != 0 ? tmpdir : "/tmp";
+  temp_name += "/tilde-save-XXXXXX";
+  std::vector<char> temp_name_buffer(temp_name.begin(), temp_name.end());
+  temp_name_buffer.push_back(0);
+  if ((temp_fd_ = mkstemp(temp_name_buffer.data())) < 0) {
+    throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  // The file is only accessed through the file descriptor, and disappears when it is closed.
+  unlink(temp_name_buffer.data());
+  try {
+    temp_writer_.reset(new buffered_writer_t(temp_fd_, &syscalls_));
+  } catch (std::bad_alloc &) {
+    throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+  temp_writer_->write(memory_.data(), memory_.size());
+  std::string().swap(memory_);
+}
+
+void staged_output_t::write_to(int fd) {
+  if (temp_fd_ < 0) {
+    buffered_writer_t writer(fd, &syscalls_);
+    writer.write(memory_.data(), memory_.size());
+    writer.flush();
+    return;
+  }
+
+  temp_writer_->flush();
+  buffered_writer_t writer(fd, &syscalls_);
+  std::unique_ptr<char[]> buffer(new char[kWriteBufferSize]);
+  for (off_t offset = 0; offset < size_;) {
+    ssize_t read_bytes;
+    do {
+      read_bytes = pread(temp_fd_, buffer.get(), kWriteBufferSize, offset);
+      ++syscalls_;
+    } while (read_bytes < 0 && errno == EINTR);
+    if (read_bytes <= 0) {
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, read_bytes < 0 ? errno : EIO);
+    }
+    writer.write(buffer.get(), read_bytes);
+    offset += read_bytes;
+  }
+  writer.flush();
+}
@@ -15,13 +15,70 @@
 #define FILEWRAPPER_H
 
 #include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
 #include <string>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <transcript/transcript.h>
 #include <unistd.h>
 
 #define FILE_BUFFER_SIZE 1024
 //~ #define FILE_BUFFER_SIZE 102
 
+class rw_result_t {
+ public:
+  enum stop_reason_t {
+    SUCCESS,
+    FILE_EXISTS,
+    READ_ONLY_FILE,
+    BACKUP_FAILED,
+    ERRNO_ERROR,
+    ERRNO_ERROR_FILE_UNTOUCHED,
+    CONVERSION_OPEN_ERROR,
+    CONVERSION_IMPRECISE,
+    CONVERSION_ERROR,
+    CONVERSION_ILLEGAL,
+    CONVERSION_TRUNCATED,
+    BOM_FOUND,
+    MODE_RESET_FAILED,
+    INTERNAL_ERROR,
+    RACE_ON_FILE,
+    LOAD_IN_PROGRESS,
+    LOAD_INCOMPLETE,
+    SAVE_IN_PROGRESS,
+    ALREADY_SAVING,
+  };
+
+ private:
+  stop_reason_t reason = SUCCESS;
+  union {
+    int errno_error;
+    transcript_error_t transcript_error;
+  };
+
+ public:
+  rw_result_t() = default;
+  explicit rw_result_t(stop_reason_t _reason) : reason(_reason), errno_error(errno) {}
+  rw_result_t(stop_reason_t _reason, int _errno_error)
+      : reason(_reason), errno_error(_errno_error) {}
+  rw_result_t(stop_reason_t _reason, transcript_error_t _transcript_error)
+      : reason(_reason), transcript_error(_transcript_error) {}
+  int get_errno_error() { return errno_error; }
+  transcript_error_t get_transcript_error() { return transcript_error; }
+  operator int() const { return static_cast<int>(reason); }
+};
+
+/** Number of characters substituted while converting a file. */
+struct conversion_stats_t {
+  // Characters converted using a fallback, or replaced because they are not in Unicode.
+  size_t imprecise = 0;
+  // Illegal sequences replaced by the substitution character.
+  size_t illegal = 0;
+};
+
 class buffer_t {
  protected:
   int fill = 0;
@@ -30,10 +87,21 @@ class buffer_t {
  public:
   buffer_t() = default;
   virtual ~buffer_t() = default;
-  const char *get_buffer() { return buffer; }
+  virtual const char *get_buffer() { return buffer; }
   virtual int get_fill() const { return fill; }
   virtual char operator[](int idx) const { return buffer[idx]; }
-  virtual bool fill_buffer(int used) = 0;
+  /** Discard the first @p used bytes of the buffer, and read more data.
+
+      Problems are reported through @p event, which is left untouched if there are none. Any text
+      before the problem is returned by the preceding calls first. After a conversion problem,
+      reading can be continued by calling fill_buffer again. The problem is then handled as the
+      user allowed: for example, after a report of an illegal sequence, the next illegal
+      sequences are replaced and counted in the conversion statistics.
+      @return @c true if new data is available, @c false at the end of the file or if @p event
+          was set.
+  */
+  virtual bool fill_buffer(int used, rw_result_t *event) = 0;
+  virtual conversion_stats_t get_conversion_stats() const { return conversion_stats_t(); }
 };
 
 class read_buffer_t : public buffer_t {
@@ -42,7 +110,7 @@ class read_buffer_t : public buffer_t {
 
  public:
   explicit read_buffer_t(int _fd) : fd(_fd) {}
-  bool fill_buffer(int used) override;
+  bool fill_buffer(int used, rw_result_t *event) override;
 };
 
 class transcript_buffer_t : public buffer_t {
@@ -51,6 +119,9 @@ class transcript_buffer_t : public buffer_t {
   int buffer_index, conversion_flags;
   transcript_t *handle;
   bool at_eof;
+  conversion_stats_t stats;
+  // A problem found after the text in the buffer, which is reported by the next fill_buffer.
+  rw_result_t pending_event;
 
  public:
   transcript_buffer_t(buffer_t *_buffer, transcript_t *_handle)
@@ -60,7 +131,75 @@ class transcript_buffer_t : public buffer_t {
         handle(_handle),
         at_eof(false) {}
   ~transcript_buffer_t() override;
-  bool fill_buffer(int used) override;
+  bool fill_buffer(int used, rw_result_t *event) override;
+  conversion_stats_t get_conversion_stats() const override { return stats; }
+};
+
+/** Conversion of a file to UTF-8 using multiple threads.
+
+    The input is split into large chunks at newline characters, and the chunks are converted
+    concurrently, each with its own converter. This is only correct for encodings without shift
+    states, in which a newline byte is always a complete character (see is_supported). Conversion
+    problems are reported in the same way and at the same point in the text as by
+    transcript_buffer_t.
+*/
+class parallel_transcript_buffer_t : public buffer_t {
+ private:
+  struct chunk_t {
+    std::string input;
+    std::string output;
+    // Number of bytes of input converted, which is less than the input size if result indicates
+    // a problem.
+    size_t converted = 0;
+    int flags;
+    transcript_error_t result = TRANSCRIPT_SUCCESS;
+    conversion_stats_t stats;
+  };
+
+  int fd;
+  transcript_t *handle;
+  std::string encoding;
+  int conversion_flags;
+  size_t max_in_flight;
+  bool at_eof = false, all_started = false, first_chunk = true, resume_pending = false;
+  std::string next_input;
+  std::deque<std::future<std::unique_ptr<chunk_t>>> in_flight;
+  std::unique_ptr<chunk_t> current;
+  size_t current_pos = 0;
+  conversion_stats_t stats;
+  // A problem found after the text of the current chunk, which is reported when it has been used.
+  rw_result_t pending_event;
+  // The result of reading the input, which is reported after the chunks read before it.
+  rw_result_t read_result;
+
+  bool read_chunk(std::string *input);
+  void start_conversions();
+  void set_current(std::unique_ptr<chunk_t> chunk);
+  static void convert(transcript_t *handle, chunk_t *chunk);
+  static std::unique_ptr<chunk_t> convert_with_new_handle(const std::string &encoding,
+                                                          chunk_t *chunk);
+
+ public:
+  /** Create a new parallel_transcript_buffer_t.
+      @param _fd The file to read.
+      @param _handle The converter to use for parts of the input that need to be converted again
+          after a conversion problem. It is closed when the parallel_transcript_buffer_t is
+          destroyed.
+      @param _encoding The name of the encoding, to open a converter for each chunk.
+      @param threads The maximum number of chunks to convert concurrently.
+  */
+  parallel_transcript_buffer_t(int _fd, transcript_t *_handle, const char *_encoding,
+                               size_t threads);
+  ~parallel_transcript_buffer_t() override;
+  const char *get_buffer() override;
+  int get_fill() const override;
+  char operator[](int idx) const override;
+  bool fill_buffer(int used, rw_result_t *event) override;
+  conversion_stats_t get_conversion_stats() const override { return stats; }
+
+  /** Check whether @p encoding can be converted in parallel, and whether that is useful on this
+      machine. */
+  static bool is_supported(const char *encoding);
 };
 
 class file_read_wrapper_t {
@@ -68,19 +207,157 @@ class file_read_wrapper_t {
   buffer_t *buffer;
 
  public:
-  explicit file_read_wrapper_t(int fd, transcript_t *handle = nullptr);
+  /** Create a new file_read_wrapper_t.
+      @param fd The file to read.
+      @param handle The converter to use, or @c nullptr if the file is UTF-8.
+      @param parallel_encoding If not @c nullptr, the name of the encoding @p handle converts from.
+          The conversion is then done by a parallel_transcript_buffer_t.
+  */
+  explicit file_read_wrapper_t(int fd, transcript_t *handle = nullptr,
+                               const char *parallel_encoding = nullptr);
   ~file_read_wrapper_t();
   const char *get_buffer();
   int get_fill();
-  bool fill_buffer(int used);
+  bool fill_buffer(int used, rw_result_t *event);
+  conversion_stats_t get_conversion_stats() const;
+};
+
+/** Read-only memory mapping of a complete regular file.
+
+    This allows UTF-8 files, which need no conversion, to be split into lines straight from the
+    page cache instead of being pushed through a @c buffer_t chain.
+
+    Reading a page of the mapping that lies beyond the end of the file, because the file was
+    truncated after it was mapped, normally raises SIGBUS. Instead, such pages read as zeroes, and
+    get_intact_size reports where the replaced pages start. Only the data up to the current size of
+    the file is valid.
+
+    A mapping may be handed from one thread to another, but only the thread that owns it may read
+    it. The destructor relies on this: it must not unmap pages that a SIGBUS handler on another
+    thread is replacing.
+*/
+class mapped_file_t {
+ private:
+  const char *data_;
+  size_t size_;
+  int slot_;
+  struct stat file_info_;
+
+  mapped_file_t(const char *data, size_t size, int slot, const struct stat &file_info)
+      : data_(data), size_(size), slot_(slot), file_info_(file_info) {}
+
+ public:
+  ~mapped_file_t();
+  mapped_file_t(const mapped_file_t &) = delete;
+  mapped_file_t &operator=(const mapped_file_t &) = delete;
+
+  /** Map the file referred to by @p fd.
+      @param prefetch Whether the file is mapped ahead of being loaded. A limited number of files
+          can be mapped at the same time, part of which is reserved for files being loaded.
+      @return @c nullptr if the file can not be mapped, e.g. because it is a pipe or is empty. In
+          that case the caller should fall back to a @c file_read_wrapper_t.
+  */
+  static std::unique_ptr<mapped_file_t> create(int fd, bool prefetch = false);
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  /** Get the number of bytes at the start of the mapping that have not been replaced by zeroes.
+      This is less than size() only if the file was truncated, and a page past its new end was
+      read. */
+  size_t get_intact_size() const;
+  /** Get the state of the file at the time it was mapped. */
+  const struct stat &get_file_info() const { return file_info_; }
+};
+
+/** Collects small writes to a file descriptor in a large buffer.
+
+    Writes that don't fit in the buffer are written together with the buffered data using
+    @c writev, such that large writes need not be copied. The number of system calls is counted,
+    to allow checking how well writes are coalesced.
+*/
+class buffered_writer_t {
+ private:
+  int fd_;
+  std::unique_ptr<char[]> buffer_;
+  size_t fill_ = 0;
+  size_t *syscalls_;
+
+  void write_vector(struct iovec *iov, int count);
+
+ public:
+  /** Create a buffered_writer_t for @p fd. The number of system calls is added to
+      @p syscalls. */
+  buffered_writer_t(int fd, size_t *syscalls);
+  /** Add @p bytes bytes to the output. Throws an @c rw_result_t on error. */
+  void write(const char *buffer, size_t bytes);
+  /** Write the buffered data. Throws an @c rw_result_t on error. */
+  void flush();
+};
+
+/** Converted contents of a file that is being saved.
+
+    The contents are converted once, before the file is opened for writing, such that conversion
+    problems can be reported while the file is still untouched. The same output is then written to
+    the file. Small outputs are kept in memory, larger ones in an unlinked temporary file.
+*/
+class staged_output_t {
+ private:
+  std::string memory_;
+  int temp_fd_ = -1;
+  std::unique_ptr<buffered_writer_t> temp_writer_;
+  off_t size_ = 0;
+  size_t syscalls_ = 0;
+
+  void spill();
+
+ public:
+  staged_output_t() = default;
+  ~staged_output_t();
+  staged_output_t(const staged_output_t &) = delete;
+  staged_output_t &operator=(const staged_output_t &) = delete;
+
+  /** Add @p bytes bytes to the output. Throws an @c rw_result_t on error. */
+  void append(const char *buffer, size_t bytes);
+  /** Write the complete output to @p fd, at its current offset. Throws an @c rw_result_t on
+      error. */
+  void write_to(int fd);
+  off_t size() const { return size_; }
+  /** Get the number of system calls used to read and write the output so far. */
+  size_t get_syscalls() const { return syscalls_; }
 };
 
 class file_write_wrapper_t {
  private:
   int fd_, conversion_flags_;
   transcript_t *handle_;
+  staged_output_t *staged_ = nullptr;
+  std::unique_ptr<buffered_writer_t> writer_;
+  size_t syscalls_ = 0;
   off_t written_size_ = 0;
 
+  /* Text is converted to NFC before writing. ASCII text is always in NFC, so only the other
+     characters, together with the ASCII character before them, go through normalizer_. It is
+     created when first needed, and reused for the rest of the file. */
+  struct uninorm_filter *normalizer_ = nullptr;
+  bool normalizer_pending_ = false;
+  // Output of normalizer_ that has not been converted yet.
+  std::string normalized_;
+  // The last character of the last run of ASCII text, which may combine with the text after it.
+  int held_ascii_ = -1;
+  /* Input of normalizer_ since it was last flushed, and how much of it the output matched. Used
+     to find out whether normalization changed the text. */
+  std::string normalizer_input_;
+  size_t normalizer_matched_ = 0;
+  bool normalization_changed_ = false;
+  bool imprecise_ = false;
+
+  void normalize(const char *buffer, size_t bytes);
+  void flush_normalizer();
+  void release_held_ascii();
+  static int add_normalized(void *data, uint32_t c);
+  void convert(const char *buffer, size_t bytes);
+  void output(const char *buffer, size_t bytes);
+
  public:
   explicit file_write_wrapper_t(int fd, transcript_t *handle = nullptr)
       : fd_(fd),
@@ -89,8 +366,23 @@ class file_write_wrapper_t {
     if (handle_) {
       transcript_from_unicode_reset(handle_);
     }
+    if (fd_ >= 0) {
+      writer_.reset(new buffered_writer_t(fd_, &syscalls_));
+    }
+  }
+  /** Create a file_write_wrapper_t that appends to @p staged instead of writing to a file. */
+  explicit file_write_wrapper_t(staged_output_t *staged, transcript_t *handle = nullptr)
+      : file_write_wrapper_t(-1, handle) {
+    staged_ = staged;
   }
+  ~file_write_wrapper_t();
+  file_write_wrapper_t(const file_write_wrapper_t &) = delete;
+  file_write_wrapper_t &operator=(const file_write_wrapper_t &) = delete;
+
   void write(const char *buffer, size_t bytes);
+  /** Write the text held back for normalization, and the data buffered for the file. This must be
+      called after the last write. */
+  void flush();
 
   // Get the state of the conversion flags. This may have changed from the initial setting by
   // imprecise conversions.
@@ -103,6 +395,9 @@ class file_write_wrapper_t {
   }
 
   off_t written_size() const { return written_size_; }
+  /** Check whether NFC normalization changed any of the text written and flushed so far. If not,
+      the output equals the input (for UTF-8 output). */
+  bool normalization_changed() const { return normalization_changed_; }
 };
 
 #endif
@@ -0,0 +1,86 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string>
+#include <vector>
+
+#include "tilde/highlightcache.h"
+#include "tilde/util.h"
+
+namespace {
+
+struct shared_highlight_t {
+  std::string lang_file;
+  int flags;
+  t3_highlight_t *highlight;
+  int references;
+  // Set by forget_shared_highlights, after which the definition is no longer shared by new loads.
+  bool forgotten;
+};
+
+// Only few languages are used at a time, so a linear search is good enough.
+std::vector<shared_highlight_t> shared_highlights;
+
+}  // namespace
+
+t3_highlight_t *load_shared_highlight(const char *lang_file, int flags,
+                                      t3_highlight_error_t *error) {
+  // Verbose errors only change what is reported if loading fails.
+  int shared_flags = flags & ~T3_HIGHLIGHT_VERBOSE_ERROR;
+  for (shared_highlight_t &shared : shared_highlights) {
+    if (!shared.forgotten && shared.flags == shared_flags && shared.lang_file == lang_file) {
+      ++shared.references;
+      return shared.highlight;
+    }
+  }
+
+  t3_highlight_t *highlight = t3_highlight_load(lang_file, map_highlight, nullptr, flags, error);
+  if (highlight != nullptr) {
+    shared_highlights.push_back({lang_file, shared_flags, highlight, 1, false});
+  }
+  return highlight;
+}
+
+t3_highlight_t *load_shared_highlight_by_filename(const char *name, int flags,
+                                                  t3_highlight_error_t *error) {
+  t3_highlight_lang_t lang;
+  if (!t3_highlight_lang_by_filename(name, flags, &lang, error)) {
+    return nullptr;
+  }
+  // The language map only contains the base name of the file.
+  t3_highlight_t *highlight =
+      load_shared_highlight(lang.lang_file, flags | T3_HIGHLIGHT_USE_PATH, error);
+  t3_highlight_free_lang(lang);
+  return highlight;
+}
+
+void release_shared_highlight(t3_highlight_t *highlight) {
+  if (highlight == nullptr) {
+    return;
+  }
+  for (auto iter = shared_highlights.begin(); iter != shared_highlights.end(); ++iter) {
+    if (iter->highlight == highlight) {
+      if (--iter->references == 0) {
+        t3_highlight_free(highlight);
+        shared_highlights.erase(iter);
+      }
+      return;
+    }
+  }
+}
+
+void forget_shared_highlights() {
+  for (shared_highlight_t &shared : shared_highlights) {
+    shared.forgotten = true;
+  }
+}
@@ -0,0 +1,42 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HIGHLIGHT_CACHE_H
+#define HIGHLIGHT_CACHE_H
+
+#include <t3highlight/highlight.h>
+
+/* Loading a highlighting definition parses and compiles the .lang file and the files it includes.
+   The definitions loaded through these functions are shared by all buffers using the same
+   definition, with a reference count. A t3_highlight_t is not changed by matching, so sharing it is
+   safe as long as each buffer uses its own t3_highlight_match_t. The definitions are loaded with
+   map_highlight, and may only be used from the UI thread. */
+
+/** Load the highlighting definition @p lang_file with @p flags, or share the one loaded before.
+    @return The definition, which must be released with release_shared_highlight, or @c nullptr
+        if it could not be loaded. In that case, @p error is filled in if it is not @c nullptr.
+*/
+t3_highlight_t *load_shared_highlight(const char *lang_file, int flags,
+                                      t3_highlight_error_t *error);
+/** Load the highlighting definition for the file @p name, like t3_highlight_load_by_filename.
+    @return As for load_shared_highlight.
+*/
+t3_highlight_t *load_shared_highlight_by_filename(const char *name, int flags,
+                                                  t3_highlight_error_t *error);
+/** Release a definition returned by one of the functions above. @p highlight may be @c nullptr. */
+void release_shared_highlight(t3_highlight_t *highlight);
+/** Make later loads compile the definitions again, because the mapping of style names to
+    attributes changed. Definitions that are in use remain valid until they are released. */
+void forget_shared_highlights();
+
+#endif
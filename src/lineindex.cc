@@ -0,0 +1,196 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <unistd.h>
+
+#include "tilde/lineindex.h"
+#include "tilde/log.h"
+#include "tilde/string_util.h"
+#include "tilde/util.h"
+
+// The deadline is checked after scanning each block of this size.
+static const size_t kScanBlockSize = 4 * 1024 * 1024;
+
+static const char kCacheDir[] = "line-index";
+static const char kCacheMagic[8] = {'T', 'L', 'I', 'D', 'X', '\n', 1, 0};
+
+/* Layout of the start of a cache file. It is followed by the name of the file, and by the
+   offsets. The cache is never shared between machines, so the native byte order is used. */
+struct cache_header_t {
+  char magic[sizeof(kCacheMagic)];
+  uint64_t file_size, file_mtime_sec, file_mtime_nsec, file_dev, file_ino;
+  uint64_t stride, newlines, offsets, name_size;
+};
+
+line_index_t::line_index_t(const std::string &_name, const struct stat &file_info)
+    : name(_name),
+      file_size(file_info.st_size),
+      file_mtime_sec(file_info.st_mtim.tv_sec),
+      file_mtime_nsec(file_info.st_mtim.tv_nsec),
+      file_dev(file_info.st_dev),
+      file_ino(file_info.st_ino),
+      newlines(0),
+      scanned(0),
+      complete(false) {
+  if (!read_cache()) {
+    offsets.assign(1, 0);
+  }
+}
+
+bool line_index_t::build(const char *data, size_t size,
+                         std::chrono::steady_clock::time_point deadline) {
+  while (scanned < size) {
+    const char *ptr = data + scanned;
+    const char *block_end = data + std::min(size, scanned + kScanBlockSize);
+
+    while ((ptr = static_cast<const char *>(memchr(ptr, '\n', block_end - ptr))) != nullptr) {
+      ++ptr;
+      ++newlines;
+      if (newlines % kStride == 0) {
+        offsets.push_back(ptr - data);
+      }
+    }
+    scanned = block_end - data;
+    if (scanned < size && std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+  }
+  complete = true;
+  write_cache();
+  return true;
+}
+
+size_t line_index_t::get_line_offset(const char *data, size_t size, text_pos_t line) const {
+  line = std::max<text_pos_t>(0, std::min(line, newlines));
+  size_t offset = offsets[line / kStride];
+  for (text_pos_t i = line % kStride; i > 0; --i) {
+    const char *newline = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+    if (newline == nullptr) {
+      break;
+    }
+    offset = newline - data + 1;
+  }
+  return offset;
+}
+
+std::string line_index_t::get_cache_path() const {
+  std::unique_ptr<char, free_deleter> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0));
+  if (xdg_path == nullptr) {
+    return std::string();
+  }
+  std::string result;
+  strings::Append(&result, xdg_path.get(), "/", kCacheDir, "/", std::hash<std::string>()(name));
+  return result;
+}
+
+bool line_index_t::read_cache() {
+  std::string cache_path = get_cache_path();
+  if (cache_path.empty()) {
+    return false;
+  }
+  std::unique_ptr<FILE, fclose_deleter> cache_file(fopen(cache_path.c_str(), "rb"));
+  if (cache_file == nullptr) {
+    return false;
+  }
+
+  cache_header_t header;
+  if (fread(&header, sizeof(header), 1, cache_file.get()) != 1 ||
+      memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      header.file_size != file_size || header.file_mtime_sec != file_mtime_sec ||
+      header.file_mtime_nsec != file_mtime_nsec || header.file_dev != file_dev ||
+      header.file_ino != file_ino || header.stride != static_cast<uint64_t>(kStride) ||
+      header.offsets != header.newlines / kStride + 1 || header.name_size != name.size()) {
+    return false;
+  }
+
+  std::string cached_name(name.size(), 0);
+  if (fread(&cached_name[0], 1, name.size(), cache_file.get()) != name.size() ||
+      cached_name != name) {
+    return false;
+  }
+  std::vector<uint64_t> cached_offsets(header.offsets);
+  if (fread(cached_offsets.data(), sizeof(uint64_t), cached_offsets.size(), cache_file.get()) !=
+          cached_offsets.size() ||
+      cached_offsets.front() != 0 || cached_offsets.back() > file_size) {
+    return false;
+  }
+
+  offsets.swap(cached_offsets);
+  newlines = header.newlines;
+  scanned = file_size;
+  complete = true;
+  lprintf("Using cached line index %s for %s\n", cache_path.c_str(), name.c_str());
+  return true;
+}
+
+void line_index_t::write_cache() const {
+  std::unique_ptr<char, free_deleter> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0));
+  if (xdg_path == nullptr) {
+    return;
+  }
+  std::string cache_dir;
+  strings::Append(&cache_dir, xdg_path.get(), "/", kCacheDir);
+  xdg_path.reset();
+  if (!make_dirs(&cache_dir[0])) {
+    lprintf("Could not create line index cache dir: %s\n", strerror(errno));
+    return;
+  }
+
+  /* Write to a temporary file first, such that another instance never reads a partial index. */
+  std::string cache_path = get_cache_path();
+  std::string temp_path;
+  strings::Append(&temp_path, cache_path, ".", getpid());
+  int fd = open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  if (fd < 0) {
+    lprintf("Could not open line index cache file: %s: %s\n", temp_path.c_str(), strerror(errno));
+    return;
+  }
+  std::unique_ptr<FILE, fclose_deleter> cache_file(fdopen(fd, "wb"));
+  if (cache_file == nullptr) {
+    close(fd);
+    unlink(temp_path.c_str());
+    return;
+  }
+
+  cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.file_size = file_size;
+  header.file_mtime_sec = file_mtime_sec;
+  header.file_mtime_nsec = file_mtime_nsec;
+  header.file_dev = file_dev;
+  header.file_ino = file_ino;
+  header.stride = kStride;
+  header.newlines = newlines;
+  header.offsets = offsets.size();
+  header.name_size = name.size();
+
+  bool success = fwrite(&header, sizeof(header), 1, cache_file.get()) == 1 &&
+                 fwrite(name.data(), 1, name.size(), cache_file.get()) == name.size() &&
+                 fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), cache_file.get()) ==
+                     offsets.size();
+  success = fclose(cache_file.release()) == 0 && success;
+  if (!success || rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+    lprintf("Could not write line index cache file: %s: %s\n", cache_path.c_str(),
+            strerror(errno));
+    unlink(temp_path.c_str());
+  }
+}
@@ -0,0 +1,78 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include <t3widget/widget.h>
+
+using namespace t3widget;
+
+/** Index of the line starts in a (memory mapped) file.
+
+    To keep the index small for files with hundreds of millions of lines, only the offset of every
+    kStride-th line is stored. The remaining lines are found by scanning forward from there.
+
+    Once complete, the index is stored in the cache directory, such that reopening the same file
+    does not require scanning it again. The cached index is only used if the path, size,
+    modification time and inode of the file all match.
+*/
+class line_index_t {
+ public:
+  static const text_pos_t kStride = 1024;
+
+  /** Create an index for file @p name, with the information from @c stat in @p file_info.
+
+      If a matching index is found in the cache directory, it is loaded and the index is complete
+      immediately.
+  */
+  line_index_t(const std::string &name, const struct stat &file_info);
+
+  /** Continue building the index for the @p size bytes at @p data.
+
+      The index is built in steps, such that the caller can handle user input in between.
+      @return @c true if the index is complete, @c false if @p deadline was reached first.
+  */
+  bool build(const char *data, size_t size, std::chrono::steady_clock::time_point deadline);
+  bool is_complete() const { return complete; }
+  /** Get the number of bytes indexed so far. */
+  size_t get_scanned_size() const { return scanned; }
+
+  /** Get the number of lines in the file. Only valid when the index is complete. */
+  text_pos_t get_line_count() const { return newlines + 1; }
+  /** Get the offset of the first byte of line @p line (counting from 0) in @p data.
+      Lines past the end of the file are mapped to the last line.
+  */
+  size_t get_line_offset(const char *data, size_t size, text_pos_t line) const;
+
+ private:
+  std::string get_cache_path() const;
+  bool read_cache();
+  void write_cache() const;
+
+  std::string name;
+  uint64_t file_size, file_mtime_sec, file_mtime_nsec, file_dev, file_ino;
+  // offsets[i] is the offset of line i * kStride.
+  std::vector<uint64_t> offsets;
+  text_pos_t newlines;
+  size_t scanned;
+  bool complete;
+};
+
+#endif
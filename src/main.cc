@@ -95,6 +95,7 @@ class main_t : public main_window_base_t {
   void set_misc_options();
   void set_highlight(t3_highlight_t *highlight, const char *name);
   void save_as_done(stepped_process_t *process);
+  void save_all_done(stepped_process_t *process);
 
   static key_bindings_t<action_id_t> key_bindings;
 };
@@ -123,6 +124,7 @@ main_t::main_t() {
   panel->insert_item(nullptr, "_Close", "^W", action_id_t::FILE_CLOSE);
   panel->insert_item(nullptr, "_Save", "^S", action_id_t::FILE_SAVE);
   panel->insert_item(nullptr, "Save _As...", "", action_id_t::FILE_SAVE_AS);
+  panel->insert_item(nullptr, "Save A_ll", "", action_id_t::FILE_SAVE_ALL);
   panel->insert_separator();
   panel->insert_item(nullptr, "Re_draw Screen", "", action_id_t::FILE_REPAINT);
   panel->insert_item(nullptr, "S_uspend", "", action_id_t::FILE_SUSPEND);
@@ -340,7 +342,9 @@ void main_t::menu_activated(int id) {
         // dialog.
         open_file_dialog->reset();
       }
-      load_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this));
+      // Large files are shown as soon as the first screenful has been loaded.
+      load_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this),
+                              bind_front(&main_t::switch_to_new_buffer, this));
       break;
     }
 
@@ -349,14 +353,19 @@ void main_t::menu_activated(int id) {
       close_process_t::execute(bind_front(&main_t::close_cb, this), get_current()->get_text());
       break;
     case action_id_t::FILE_SAVE:
-      save_process_t::execute(bind_front(&main_t::save_as_done, this), get_current()->get_text());
+      save_process_t::execute(bind_front(&main_t::save_as_done, this), get_current()->get_text(),
+                              option.background_save);
       break;
     case action_id_t::FILE_SAVE_AS:
       save_as_process_t::execute(bind_front(&main_t::save_as_done, this),
-                                 get_current()->get_text());
+                                 get_current()->get_text(), option.background_save);
+      break;
+    case action_id_t::FILE_SAVE_ALL:
+      save_all_process_t::execute(bind_front(&main_t::save_all_done, this));
       break;
     case action_id_t::FILE_OPEN_RECENT:
-      open_recent_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this));
+      open_recent_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this),
+                                     bind_front(&main_t::switch_to_new_buffer, this));
       break;
     case action_id_t::FILE_REPAINT:
       t3widget::redraw();
@@ -621,6 +630,11 @@ void main_t::save_as_done(stepped_process_t *process) {
   }
 }
 
+void main_t::save_all_done(stepped_process_t *process) {
+  (void)process;
+  get_current()->draw_info_window();
+}
+
 static void configure_input(bool cancel_selects_default) {
   input_selection_dialog_t *input_selection;
   int height, width, is_width, is_height;
@@ -884,6 +898,9 @@ int main(int argc, char *argv[]) {
   load_cli_file_process_t::execute(bind_front(&main_t::load_cli_files_done, main_window));
   setup_signal_handlers();
   int retval = main_loop();
+  for (file_buffer_t *buffer : open_files) {
+    buffer->discard_pre_backup();
+  }
   if (option.save_recent_files) {
     recent_files.write_to_disk();
   }
@@ -278,23 +278,6 @@ void recent_files_t::load_from_disk() {
   lprintf("Loaded %zd recent files\n", recent_file_infos.size());
 }
 
-static bool make_dirs(char *dir) {
-  char *slash = strchr(dir + (dir[0] == '/'), '/');
-
-  while (slash != nullptr) {
-    *slash = 0;
-    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
-      return false;
-    }
-    *slash = '/';
-    slash = strchr(slash + 1, '/');
-  }
-  if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
-    return false;
-  }
-  return true;
-}
-
 void recent_files_t::write_to_disk() {
   std::unique_ptr<char, free_deleter> xdg_path(
       t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0));
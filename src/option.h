@@ -22,6 +22,7 @@
 #include <t3window/window.h>
 
 #include "tilde/attributemap.h"
+#include "tilde/durability.h"
 #include "tilde/util.h"
 
 using namespace t3widget;
@@ -91,9 +92,14 @@ struct options_t {
   optional<bool> disable_primary_selection_over_ssh;
   optional<bool> save_recent_files;
   optional<bool> restore_cursor_position;
+  optional<bool> background_save;
+  optional<bool> atomic_save;
+  optional<bool> pre_backup;
+  optional<save_durability_t> save_durability;
 
   optional<int> tabsize;
   optional<size_t> max_recent_files;
+  optional<size_t> large_file_size;
 };
 
 struct runtime_options_t {
@@ -109,7 +115,19 @@ struct runtime_options_t {
   bool hide_menubar;
   bool save_recent_files;
   bool restore_cursor_position;
+  // Write files on a worker thread, from a copy of the buffer, such that editing can continue.
+  bool background_save;
+  /* Write files to a temporary file which then replaces the original, instead of overwriting
+     the original after copying it to a backup file. */
+  bool atomic_save;
+  /* Copy a file to a temporary backup on a worker thread when it is loaded, such that the first
+     save does not have to copy the file before writing it. */
+  bool pre_backup;
+  // The default for how saved files are flushed to disk. Buffers may override this.
+  save_durability_t save_durability;
   size_t max_recent_files;
+  // Size in MiB from which files are shown as a window on the file. Zero disables this.
+  size_t large_file_size;
   optional<int> key_timeout;
   attribute_map_t highlights;
   t3_attr_t brace_highlight;
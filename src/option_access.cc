@@ -61,9 +61,17 @@ option_access_t option_access[] = {
                     &options_t::save_recent_files, true),
     option_access_t("restore_cursor_position", &runtime_options_t::restore_cursor_position,
                     &options_t::restore_cursor_position, true),
+    option_access_t("background_save", &runtime_options_t::background_save,
+                    &options_t::background_save, false),
+    option_access_t("atomic_save", &runtime_options_t::atomic_save, &options_t::atomic_save, false),
+    option_access_t("pre_backup", &runtime_options_t::pre_backup, &options_t::pre_backup, false),
+    option_access_t("save_durability", &runtime_options_t::save_durability,
+                    &options_t::save_durability, save_durability_t::FULL),
     option_access_t("tabsize", &runtime_options_t::tabsize, &options_t::tabsize, 8),
     option_access_t("max_recent_files", &runtime_options_t::max_recent_files,
                     &options_t::max_recent_files, 16),
+    option_access_t("large_file_size", &runtime_options_t::large_file_size,
+                    &options_t::large_file_size, 1024),
     option_access_t("key_timeout", &runtime_options_t::key_timeout, &term_options_t::key_timeout),
 
     option_access_t("brace_highlight", &runtime_options_t::brace_highlight,
@@ -169,6 +177,7 @@ void get_term_options(t3_config_t *config, term_options_t *term_options) {
       case option_access_t::BOOL:
       case option_access_t::INT:
       case option_access_t::SIZE_T:
+      case option_access_t::DURABILITY:
         break;
       case option_access_t::TERM_BOOL:
         if (tmp != nullptr) {
@@ -209,6 +218,15 @@ void get_default_options(t3_config_t *config) {
         case option_access_t::SIZE_T:
           default_option.*access.size_t_option = t3_config_get_int64(tmp);
           break;
+        case option_access_t::DURABILITY: {
+          // Unknown names are ignored, such that the default is used.
+          save_durability_t durability;
+          const char *durability_name = t3_config_get_string(tmp);
+          if (durability_name != nullptr && parse_durability_name(durability_name, &durability)) {
+            default_option.*access.durability_option = durability;
+          }
+          break;
+        }
         case option_access_t::TERM_BOOL:
         case option_access_t::TERM_OPTIONAL_INT:
         case option_access_t::TERM_T3_ATTR_T:
@@ -238,6 +256,12 @@ typename std::enable_if<std::is_same<ValueType, size_t>::value>::type set_option
   t3_config_add_int64(config, name.c_str(), value);
 }
 
+template <typename ValueType>
+typename std::enable_if<std::is_same<ValueType, save_durability_t>::value>::type set_option_helper(
+    t3_config_t *config, const std::string &name, ValueType value) {
+  t3_config_add_string(config, name.c_str(), get_durability_name(value));
+}
+
 template <typename OptionType, typename MemberPtr>
 void set_option(t3_config_t *config, const std::string &name, const OptionType &opts,
                 MemberPtr member) {
@@ -307,6 +331,7 @@ void set_term_options(t3_config_t *config, const term_options_t &term_options) {
       case option_access_t::BOOL:
       case option_access_t::INT:
       case option_access_t::SIZE_T:
+      case option_access_t::DURABILITY:
         break;
       case option_access_t::TERM_BOOL:
         set_option(config, access.name, term_options, access.bool_term_opt);
@@ -346,6 +371,9 @@ void set_default_options(t3_config_t *config) {
       case option_access_t::SIZE_T:
         set_option(config, access.name, default_option, access.size_t_option);
         break;
+      case option_access_t::DURABILITY:
+        set_option(config, access.name, default_option, access.durability_option);
+        break;
       case option_access_t::TERM_BOOL:
       case option_access_t::TERM_OPTIONAL_INT:
       case option_access_t::TERM_T3_ATTR_T:
@@ -377,6 +405,12 @@ void derive_runtime_options() {
               (default_option.*access.size_t_option).value_or(access.size_t_default);
         }
         break;
+      case option_access_t::DURABILITY:
+        if (access.durability_runtime_opt != nullptr) {
+          option.*access.durability_runtime_opt =
+              (default_option.*access.durability_option).value_or(access.durability_default);
+        }
+        break;
       case option_access_t::TERM_BOOL:
         if (access.bool_runtime_opt != nullptr) {
           option.*access.bool_runtime_opt =
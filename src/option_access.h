@@ -10,6 +10,7 @@ struct option_access_t {
     BOOL,
     INT,
     SIZE_T,
+    DURABILITY,
     TERM_BOOL,
     TERM_OPTIONAL_INT,
     TERM_T3_ATTR_T,
@@ -20,6 +21,7 @@ struct option_access_t {
     bool runtime_options_t::*bool_runtime_opt;
     int runtime_options_t::*int_runtime_opt;
     size_t runtime_options_t::*size_t_runtime_opt;
+    save_durability_t runtime_options_t::*durability_runtime_opt;
     optional<int> runtime_options_t::*optional_int_runtime_opt;
     t3_attr_t runtime_options_t::*t3_attr_t_runtime_opt;
   };
@@ -28,6 +30,7 @@ struct option_access_t {
     optional<bool> options_t::*bool_option;
     optional<int> options_t::*int_option;
     optional<size_t> options_t::*size_t_option;
+    optional<save_durability_t> options_t::*durability_option;
   };
 
   union {
@@ -40,6 +43,7 @@ struct option_access_t {
     bool bool_default;
     int int_default;
     size_t size_t_default;
+    save_durability_t durability_default;
   };
 
   optional<attribute_t> attribute;
@@ -71,6 +75,17 @@ struct option_access_t {
         int_term_opt(nullptr),
         size_t_default(dflt) {}
 
+  option_access_t(const std::string &name_arg,
+                  save_durability_t runtime_options_t::*durability_runtime_opt_arg,
+                  optional<save_durability_t> options_t::*durability_option_arg,
+                  save_durability_t dflt)
+      : type(DURABILITY),
+        name(name_arg),
+        durability_runtime_opt(durability_runtime_opt_arg),
+        durability_option(durability_option_arg),
+        int_term_opt(nullptr),
+        durability_default(dflt) {}
+
   option_access_t(const std::string &name_arg, bool runtime_options_t::*bool_runtime_opt_arg,
                   optional<bool> term_options_t::*bool_term_opt_arg, bool dflt)
       : type(TERM_BOOL),
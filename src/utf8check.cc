@@ -0,0 +1,163 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "tilde/utf8check.h"
+
+/* Returns the number of ASCII bytes at the start of data. */
+using ascii_prefix_func_t = size_t (*)(const uint8_t *data, size_t size);
+
+static size_t ascii_prefix_scalar(const uint8_t *data, size_t size) {
+  static const uint64_t kHighBits = UINT64_C(0x8080808080808080);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    if (word & kHighBits) {
+      break;
+    }
+  }
+  for (; i < size && data[i] < 0x80; i++) {
+  }
+  return i;
+}
+
+#ifdef HAS_X86_SIMD
+static size_t ascii_prefix_sse2(const uint8_t *data, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + ascii_prefix_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) static size_t ascii_prefix_avx2(const uint8_t *data,
+                                                                size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32));
+    if (_mm256_movemask_epi8(_mm256_or_si256(first, second)) != 0) {
+      break;
+    }
+  }
+  for (; i + 32 <= size; i += 32) {
+    int mask =
+        _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + ascii_prefix_sse2(data + i, size - i);
+}
+#endif
+
+static ascii_prefix_func_t select_ascii_prefix() {
+#ifdef HAS_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return ascii_prefix_avx2;
+  }
+  return ascii_prefix_sse2;
+#else
+  return ascii_prefix_scalar;
+#endif
+}
+
+/* Returns the length of the valid multi-byte sequence starting at data, or 0 if it is invalid or
+   incomplete. The ranges are those of table 3-7 of the Unicode standard. */
+static size_t multibyte_sequence_length(const uint8_t *data, const uint8_t *end) {
+  uint8_t lead = data[0];
+  size_t length;
+  uint8_t second_min = 0x80, second_max = 0xBF;
+
+  if (lead < 0xC2) {
+    return 0;
+  } else if (lead < 0xE0) {
+    length = 2;
+  } else if (lead < 0xF0) {
+    length = 3;
+    if (lead == 0xE0) {
+      second_min = 0xA0;
+    } else if (lead == 0xED) {
+      second_max = 0x9F;
+    }
+  } else if (lead < 0xF5) {
+    length = 4;
+    if (lead == 0xF0) {
+      second_min = 0x90;
+    } else if (lead == 0xF4) {
+      second_max = 0x8F;
+    }
+  } else {
+    return 0;
+  }
+
+  if (static_cast<size_t>(end - data) < length || data[1] < second_min || data[1] > second_max) {
+    return 0;
+  }
+  for (size_t i = 2; i < length; i++) {
+    if ((data[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+const char *find_invalid_utf8(const char *data, size_t size) {
+  static const ascii_prefix_func_t ascii_prefix = select_ascii_prefix();
+  const uint8_t *ptr = reinterpret_cast<const uint8_t *>(data);
+  const uint8_t *end = ptr + size;
+
+  while (ptr < end) {
+    ptr += ascii_prefix(ptr, end - ptr);
+    // Text in non-Latin scripts consists mostly of multi-byte sequences, so check those in a loop.
+    while (ptr < end && *ptr >= 0x80) {
+      size_t length = multibyte_sequence_length(ptr, end);
+      if (length == 0) {
+        return reinterpret_cast<const char *>(ptr);
+      }
+      ptr += length;
+    }
+  }
+  return nullptr;
+}
+
+size_t ascii_prefix_length(const char *data, size_t size) {
+  static const ascii_prefix_func_t ascii_prefix = select_ascii_prefix();
+  return ascii_prefix(reinterpret_cast<const uint8_t *>(data), size);
+}
+
+void replace_invalid_utf8(const char *data, size_t size, std::string *result) {
+  const char *end = data + size;
+  while (data < end) {
+    const char *invalid = find_invalid_utf8(data, end - data);
+    if (invalid == nullptr) {
+      result->append(data, end - data);
+      return;
+    }
+    result->append(data, invalid - data);
+    result->append("\xef\xbf\xbd");
+    data = invalid + 1;
+  }
+}
@@ -0,0 +1,41 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef UTF8CHECK_H
+#define UTF8CHECK_H
+
+#include <cstddef>
+#include <string>
+
+/** Check whether a block of text is valid UTF-8.
+
+    This is a faster replacement for libunistring's u8_check, and accepts exactly the same input:
+    well-formed UTF-8 without overlong encodings, surrogates or code points above U+10FFFF. Runs of
+    ASCII bytes are skipped using SSE2 or AVX2, depending on the CPU.
+
+    @return A pointer to the first byte of the first invalid or incomplete sequence, or @c nullptr
+        if the whole block is valid.
+*/
+const char *find_invalid_utf8(const char *data, size_t size);
+
+/** Get the number of ASCII bytes at the start of a block of text, using SSE2 or AVX2 if
+    available. */
+size_t ascii_prefix_length(const char *data, size_t size);
+
+/** Copy a block of text, replacing each invalid byte by U+FFFD REPLACEMENT CHARACTER.
+
+    The result is appended to @p result.
+*/
+void replace_invalid_utf8(const char *data, size_t size, std::string *result);
+
+#endif
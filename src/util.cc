@@ -19,6 +19,7 @@
 #include <cstring>
 #include <string>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -122,6 +123,23 @@ void fatal(const char *fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
+bool make_dirs(char *dir) {
+  char *slash = strchr(dir + (dir[0] == '/'), '/');
+
+  while (slash != nullptr) {
+    *slash = 0;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+      return false;
+    }
+    *slash = '/';
+    slash = strchr(slash + 1, '/');
+  }
+  if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+    return false;
+  }
+  return true;
+}
+
 std::string canonicalize_path(const char *path) {
   char *realpath_result = realpath(path, nullptr);
 
@@ -109,6 +109,7 @@ void enable_debugger_on_segfault(const char *_executable);
 void set_limits();
 
 std::string canonicalize_path(const char *path);
+bool make_dirs(char *dir);
 void printf_into(std::string *message, const char *format, ...);
 
 int map_highlight(void *data, const char *name);
@@ -93,14 +93,17 @@ bool FileCopied(const std::string &a, const std::string &b) {
     ssize_t read_b = t3widget::nosig_read(fd_b, buffer_b, sizeof(buffer_b));
 
     if (read_a != read_b) {
-      std::cerr << "File " << a << " and file " << b << " have different lengths. Read results at offset " << offset << ": a=" << read_a << " b=" << read_b << "\n";
+      std::cerr << "File " << a << " and file " << b
+                << " have different lengths. Read results at offset " << offset << ": a=" << read_a
+                << " b=" << read_b << "\n";
       return false;
     }
     if (read_a == 0) {
       return true;
     }
     if (std::memcmp(buffer_a, buffer_b, read_a) != 0) {
-      std::cerr << "File " << a << " and file " << b << " have different contents when reading at offset " << offset << "\n";
+      std::cerr << "File " << a << " and file " << b
+                << " have different contents when reading at offset " << offset << "\n";
       return false;
     }
     offset += read_a;
@@ -124,8 +127,10 @@ std::pair<std::string, int> CreateFile(const std::string &dir) {
 std::pair<std::string, int> CreateFileWithContent(std::string content, const std::string &dir) {
   auto name_and_fd = CreateFile(dir);
 
-  QCHECK(t3widget::nosig_write(name_and_fd.second, content.data(), content.size()) == static_cast<ssize_t>(content.size())) <<
-      "Failed to write full content to file (" << strerror(errno) << ", " << name_and_fd.first << ")";
+  QCHECK(t3widget::nosig_write(name_and_fd.second, content.data(), content.size()) ==
+         static_cast<ssize_t>(content.size()))
+      << "Failed to write full content to file (" << strerror(errno) << ", " << name_and_fd.first
+      << ")";
   QCHECK(fsync(name_and_fd.second) == 0);
   return name_and_fd;
 }
@@ -137,15 +142,52 @@ void FillWithRandomData(const std::pair<std::string, int> &name_and_fd, size_t s
       buffer[i] = std::rand();
     }
     size_t to_write = std::min(size, sizeof(buffer));
-    QCHECK(t3widget::nosig_write(name_and_fd.second, buffer, to_write) == static_cast<ssize_t>(to_write)) <<
-        "Failed to write full content to file (" << strerror(errno) << ", " << name_and_fd.first << ")";
+    QCHECK(t3widget::nosig_write(name_and_fd.second, buffer, to_write) ==
+           static_cast<ssize_t>(to_write))
+        << "Failed to write full content to file (" << strerror(errno) << ", "
+        << name_and_fd.first << ")";
     size -= to_write;
   }
 }
 
+// Append size random bytes to the file, without changing the file position.
+void AppendRandomData(int fd, size_t size) {
+  struct stat statbuf;
+  QCHECK(fstat(fd, &statbuf) == 0);
+  std::vector<char> buffer(size);
+  for (char &c : buffer) {
+    c = std::rand();
+  }
+  QCHECK(pwrite(fd, buffer.data(), size, statbuf.st_size) == static_cast<ssize_t>(size))
+      << strerror(errno);
+}
+
+// Create a file of 1 MiB, with data at the start and at 256 KiB, and holes in between and at the
+// end.
+std::pair<std::string, int> CreateSparseFile(const std::string &dir) {
+  auto name_and_fd = CreateFileWithContent("abcd", dir);
+  QCHECK(pwrite(name_and_fd.second, "efgh", 4, 256 * 1024) == 4) << strerror(errno);
+  QCHECK(ftruncate(name_and_fd.second, 1024 * 1024) == 0) << strerror(errno);
+  QCHECK(fsync(name_and_fd.second) == 0);
+  return name_and_fd;
+}
+
+off_t AllocatedSize(int fd) {
+  struct stat statbuf;
+  QCHECK(fstat(fd, &statbuf) == 0);
+  return statbuf.st_blocks * 512;
+}
+
+dev_t DeviceOf(int fd) {
+  struct stat statbuf;
+  QCHECK(fstat(fd, &statbuf) == 0);
+  return statbuf.st_dev;
+}
+
 class CopyFileTest : public ::testing::Test {
  protected:
   ~CopyFileTest() {
+    copy_chunk_hook = nullptr;
     close(src_name_and_fd_.second);
     close(dest_name_and_fd_.second);
     unlink(src_name_and_fd_.first.c_str());
@@ -222,6 +264,206 @@ TEST_F(CopyFileTest, SendfileWithContentReflinkFs) {
   EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
 }
 
+TEST_F(CopyFileTest, SendfileSourceShrunk) {
+  // The destination starts out longer than the source, to check that it is truncated.
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFileWithContent("efghijkl", FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_sendfile(src_name_and_fd_.second, dest_name_and_fd_.second, 8), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SendfileSourceGrown) {
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_sendfile(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SendfileSourceGrownLarge) {
+  // Grown by more than the amount requested per call when the expected size has been reached.
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_sendfile(src_name_and_fd_.second, dest_name_and_fd_.second, 1024), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SendfileSourceTruncatedWhileCopying) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  copy_chunk_hook = [src_fd](off_t copied, ssize_t) {
+    if (copied == 0) {
+      QCHECK(ftruncate(src_fd, 1024 * 1024 + 5) == 0) << strerror(errno);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_sendfile(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                  3 * 1024 * 1024 + 17),
+            0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SendfileSourceAppendedWhileCopying) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  int appends = 0;
+  copy_chunk_hook = [src_fd, &appends](off_t, ssize_t result) {
+    if (result > 0 && appends < 4) {
+      ++appends;
+      AppendRandomData(src_fd, 300 * 1024);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_sendfile(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                  3 * 1024 * 1024 + 17),
+            0);
+  EXPECT_EQ(appends, 4);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SendfileSourceAppendedAtEnd) {
+  // Data is appended after the end of the file was reached, but before its size is checked.
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  bool appended = false;
+  copy_chunk_hook = [src_fd, &appended](off_t, ssize_t result) {
+    if (result == 0 && !appended) {
+      appended = true;
+      AppendRandomData(src_fd, 4096);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_sendfile(src_name_and_fd_.second, dest_name_and_fd_.second, 8), 0);
+  EXPECT_TRUE(appended);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+// ======================= splice ============================================
+TEST_F(CopyFileTest, SpliceEmptyFile) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 0), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceWithContent) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceWithContentCrossFs) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceWithLargeContent) {
+  // Larger than the pipe, such that multiple rounds through the pipe are needed.
+  const size_t size = 1536 * 1024 + 123;
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, size);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, size), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceSourceShrunk) {
+  // The destination starts out longer than the source, to check that it is truncated.
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFileWithContent("efghijkl", FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 8), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceSourceGrown) {
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceSourceGrownLarge) {
+  // Grown by more than the amount requested per call when the expected size has been reached.
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 1024), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceSourceTruncatedWhileCopying) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  copy_chunk_hook = [src_fd](off_t copied, ssize_t) {
+    if (copied == 0) {
+      QCHECK(ftruncate(src_fd, 1024 * 1024 + 5) == 0) << strerror(errno);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                3 * 1024 * 1024 + 17),
+            0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceSourceAppendedWhileCopying) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  int appends = 0;
+  copy_chunk_hook = [src_fd, &appends](off_t, ssize_t result) {
+    if (result > 0 && appends < 4) {
+      ++appends;
+      AppendRandomData(src_fd, 300 * 1024);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                3 * 1024 * 1024 + 17),
+            0);
+  EXPECT_EQ(appends, 4);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, SpliceSourceAppendedAtEnd) {
+  // Data is appended after the end of the file was reached, but before its size is checked.
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  bool appended = false;
+  copy_chunk_hook = [src_fd, &appended](off_t, ssize_t result) {
+    if (result == 0 && !appended) {
+      appended = true;
+      AppendRandomData(src_fd, 4096);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_splice(src_name_and_fd_.second, dest_name_and_fd_.second, 8), 0);
+  EXPECT_TRUE(appended);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
 // ======================= copy_file_range ===================================
 TEST_F(CopyFileTest, CopyFileRangeEmptyFile) {
   src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
@@ -243,7 +485,8 @@ TEST_F(CopyFileTest, CopyFileRangeWithContentCrossFs) {
   src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
   dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
 
-  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second, 4), EXDEV);
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second, 4),
+            EXDEV);
 }
 
 TEST_F(CopyFileTest, CopyFileRangeWithContentReflinkFs) {
@@ -254,6 +497,89 @@ TEST_F(CopyFileTest, CopyFileRangeWithContentReflinkFs) {
   EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
 }
 
+TEST_F(CopyFileTest, CopyFileRangeSourceShrunk) {
+  // The destination starts out longer than the source, to check that it is truncated.
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFileWithContent("efghijkl", FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second, 8), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, CopyFileRangeSourceGrown) {
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, CopyFileRangeSourceGrownLarge) {
+  // Grown by more than the amount requested per call when the expected size has been reached.
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second, 1024),
+            0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, CopyFileRangeSourceTruncatedWhileCopying) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  copy_chunk_hook = [src_fd](off_t copied, ssize_t) {
+    if (copied == 0) {
+      QCHECK(ftruncate(src_fd, 1024 * 1024 + 5) == 0) << strerror(errno);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                         3 * 1024 * 1024 + 17),
+            0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, CopyFileRangeSourceAppendedWhileCopying) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 17);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  int appends = 0;
+  copy_chunk_hook = [src_fd, &appends](off_t, ssize_t result) {
+    if (result > 0 && appends < 4) {
+      ++appends;
+      AppendRandomData(src_fd, 300 * 1024);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                         3 * 1024 * 1024 + 17),
+            0);
+  EXPECT_EQ(appends, 4);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, CopyFileRangeSourceAppendedAtEnd) {
+  // Data is appended after the end of the file was reached, but before its size is checked.
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  int src_fd = src_name_and_fd_.second;
+  bool appended = false;
+  copy_chunk_hook = [src_fd, &appended](off_t, ssize_t result) {
+    if (result == 0 && !appended) {
+      appended = true;
+      AppendRandomData(src_fd, 4096);
+    }
+  };
+
+  EXPECT_EQ(copy_file_by_copy_file_range(src_name_and_fd_.second, dest_name_and_fd_.second, 8), 0);
+  EXPECT_TRUE(appended);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
 // ======================= ficlone ===========================================
 TEST_F(CopyFileTest, FicloneWithContentReflinkFs) {
   src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
@@ -277,6 +603,156 @@ TEST_F(CopyFileTest, FicloneWithContentNonReflinkFs) {
   EXPECT_EQ(copy_file_by_ficlone(src_name_and_fd_.second, dest_name_and_fd_.second), ENOTSUP);
 }
 
+// ======================= copy_file_tail ====================================
+TEST_F(CopyFileTest, CopyFileTailWithContent) {
+  src_name_and_fd_ = CreateFileWithContent("abcdefgh", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  auto expected_name_and_fd = CreateFileWithContent("efgh", FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_tail(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(expected_name_and_fd.first, dest_name_and_fd_.first));
+  close(expected_name_and_fd.second);
+  unlink(expected_name_and_fd.first.c_str());
+}
+
+TEST_F(CopyFileTest, CopyFileTailAtEnd) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  auto expected_name_and_fd = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_tail(src_name_and_fd_.second, dest_name_and_fd_.second, 4), 0);
+  EXPECT_TRUE(FileCopied(expected_name_and_fd.first, dest_name_and_fd_.first));
+  close(expected_name_and_fd.second);
+  unlink(expected_name_and_fd.first.c_str());
+}
+
+TEST_F(CopyFileTest, CopyFileTailFromStart) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_tail(src_name_and_fd_.second, dest_name_and_fd_.second, 0), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+// ======================= seek_data =========================================
+TEST_F(CopyFileTest, SeekDataSparseFile) {
+  src_name_and_fd_ = CreateSparseFile(FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_seek_data(src_name_and_fd_.second, dest_name_and_fd_.second, 0), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_LT(AllocatedSize(dest_name_and_fd_.second), 256 * 1024);
+}
+
+TEST_F(CopyFileTest, SeekDataSparseFileCrossFs) {
+  src_name_and_fd_ = CreateSparseFile(FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_seek_data(src_name_and_fd_.second, dest_name_and_fd_.second, 0), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_LT(AllocatedSize(dest_name_and_fd_.second), 256 * 1024);
+}
+
+TEST_F(CopyFileTest, SeekDataNonSparseFile) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_by_seek_data(src_name_and_fd_.second, dest_name_and_fd_.second, 0), ENOTSUP);
+}
+
+TEST_F(CopyFileTest, CopyFileSparseFile) {
+  src_name_and_fd_ = CreateSparseFile(FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_LT(AllocatedSize(dest_name_and_fd_.second), 256 * 1024);
+}
+
+TEST_F(CopyFileTest, CopyFileTailSparseFile) {
+  src_name_and_fd_ = CreateSparseFile(FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  auto expected_name_and_fd = CreateFileWithContent("cd", FLAGS_non_reflink_fs_dir);
+  ASSERT_EQ(pwrite(expected_name_and_fd.second, "efgh", 4, 256 * 1024 - 2), 4);
+  ASSERT_EQ(ftruncate(expected_name_and_fd.second, 1024 * 1024 - 2), 0);
+
+  EXPECT_EQ(copy_file_tail(src_name_and_fd_.second, dest_name_and_fd_.second, 2), 0);
+  EXPECT_TRUE(FileCopied(expected_name_and_fd.first, dest_name_and_fd_.first));
+  EXPECT_LT(AllocatedSize(dest_name_and_fd_.second), 256 * 1024);
+  close(expected_name_and_fd.second);
+  unlink(expected_name_and_fd.first.c_str());
+}
+
+TEST_F(CopyFileTest, CopyFileTailInTrailingHole) {
+  src_name_and_fd_ = CreateSparseFile(FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  auto expected_name_and_fd = CreateFile(FLAGS_non_reflink_fs_dir);
+  ASSERT_EQ(ftruncate(expected_name_and_fd.second, 512 * 1024), 0);
+
+  EXPECT_EQ(copy_file_tail(src_name_and_fd_.second, dest_name_and_fd_.second, 512 * 1024), 0);
+  EXPECT_TRUE(FileCopied(expected_name_and_fd.first, dest_name_and_fd_.first));
+  close(expected_name_and_fd.second);
+  unlink(expected_name_and_fd.first.c_str());
+}
+
+// ======================= copy method cache =================================
+TEST_F(CopyFileTest, CopyMethodCachedNonReflinkFs) {
+  clear_copy_method_cache();
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  dev_t dev = DeviceOf(src_name_and_fd_.second);
+
+  EXPECT_EQ(get_cached_copy_method(dev, dev), copy_method_t::UNKNOWN);
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_EQ(get_cached_copy_method(dev, dev), copy_method_t::COPY_FILE_RANGE);
+
+  // The second copy starts with the cached method, and still succeeds.
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_EQ(get_cached_copy_method(dev, dev), copy_method_t::COPY_FILE_RANGE);
+}
+
+TEST_F(CopyFileTest, CopyMethodCachedReflinkFs) {
+  clear_copy_method_cache();
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_reflink_fs_dir);
+  dev_t dev = DeviceOf(src_name_and_fd_.second);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_EQ(get_cached_copy_method(dev, dev), copy_method_t::CLONE);
+}
+
+TEST_F(CopyFileTest, CopyMethodCachedCrossFs) {
+  clear_copy_method_cache();
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  dev_t src_dev = DeviceOf(src_name_and_fd_.second);
+  dev_t dest_dev = DeviceOf(dest_name_and_fd_.second);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  // Whether copy_file_range works between file systems depends on the kernel.
+  copy_method_t method = get_cached_copy_method(src_dev, dest_dev);
+  EXPECT_TRUE(method == copy_method_t::COPY_FILE_RANGE || method == copy_method_t::SENDFILE);
+  // Copies within either file system are not affected.
+  EXPECT_EQ(get_cached_copy_method(src_dev, src_dev), copy_method_t::UNKNOWN);
+  EXPECT_EQ(get_cached_copy_method(dest_dev, dest_dev), copy_method_t::UNKNOWN);
+  EXPECT_EQ(get_cached_copy_method(dest_dev, src_dev), copy_method_t::UNKNOWN);
+}
+
+TEST_F(CopyFileTest, ClearCopyMethodCache) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  dev_t dev = DeviceOf(src_name_and_fd_.second);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_NE(get_cached_copy_method(dev, dev), copy_method_t::UNKNOWN);
+  clear_copy_method_cache();
+  EXPECT_EQ(get_cached_copy_method(dev, dev), copy_method_t::UNKNOWN);
+}
+
 }
 
 int main(int argc, char **argv) {
@@ -298,7 +774,8 @@ int main(int argc, char **argv) {
   struct stat non_reflink_stat;
   QCHECK(stat(FLAGS_reflink_fs_dir.c_str(), &reflink_stat) == 0);
   QCHECK(stat(FLAGS_non_reflink_fs_dir.c_str(), &non_reflink_stat) == 0);
-  QCHECK(reflink_stat.st_dev != non_reflink_stat.st_dev) << "reflink enabled and non-reflink enabled file systems must be different";
+  QCHECK(reflink_stat.st_dev != non_reflink_stat.st_dev)
+      << "reflink enabled and non-reflink enabled file systems must be different";
   return RUN_ALL_TESTS();
 }
 
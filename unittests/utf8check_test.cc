@@ -0,0 +1,129 @@
+#include <cstdint>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <string>
+#include <unistr.h>
+
+#include "tilde/utf8check.h"
+
+namespace {
+
+// Offsets around the block sizes of the SSE2 and AVX2 ASCII scans, and the scalar tail after them.
+const size_t kOffsets[] = {0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129};
+const size_t kTrailingSizes[] = {0, 1, 15, 40, 100};
+
+const char *const kValidSequences[] = {
+    "\xC2\x80",         "\xDF\xBF",         "\xE0\xA0\x80",     "\xED\x9F\xBF",
+    "\xEE\x80\x80",     "\xEF\xBF\xBF",     "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF",
+};
+
+const char *const kInvalidSequences[] = {
+    // Lone continuation bytes.
+    "\x80", "\xBF",
+    // Overlong encodings.
+    "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF",
+    // Surrogates.
+    "\xED\xA0\x80", "\xED\xBF\xBF",
+    // Code points above U+10FFFF, and bytes that never occur.
+    "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF8\x88\x80\x80\x80", "\xFE", "\xFF",
+    // Lead bytes followed by too few continuation bytes.
+    "\xC2\x41", "\xE1\x80\x41", "\xF1\x80\x80\x41",
+};
+
+// Return the offset of the first invalid byte reported by u8_check, or -1 if there is none.
+ptrdiff_t U8CheckOffset(const std::string &text) {
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(text.data());
+  const uint8_t *invalid = u8_check(data, text.size());
+  return invalid == nullptr ? -1 : invalid - data;
+}
+
+// Return the offset of the first invalid byte reported by find_invalid_utf8, or -1.
+ptrdiff_t FindInvalidOffset(const std::string &text) {
+  const char *invalid = find_invalid_utf8(text.data(), text.size());
+  return invalid == nullptr ? -1 : invalid - text.data();
+}
+
+// Put sequence after offset ASCII bytes, followed by trailing_size more ASCII bytes.
+std::string Embed(const std::string &sequence, size_t offset, size_t trailing_size) {
+  return std::string(offset, 'a') + sequence + std::string(trailing_size, 'b');
+}
+
+TEST(Utf8CheckTest, EmptyText) { EXPECT_EQ(FindInvalidOffset(std::string()), -1); }
+
+TEST(Utf8CheckTest, ValidSequences) {
+  for (const char *sequence : kValidSequences) {
+    for (size_t offset : kOffsets) {
+      for (size_t trailing_size : kTrailingSizes) {
+        std::string text = Embed(sequence, offset, trailing_size);
+        EXPECT_EQ(FindInvalidOffset(text), U8CheckOffset(text))
+            << "offset " << offset << ", trailing " << trailing_size;
+        EXPECT_EQ(FindInvalidOffset(text), -1);
+      }
+    }
+  }
+}
+
+TEST(Utf8CheckTest, InvalidSequences) {
+  for (const char *sequence : kInvalidSequences) {
+    for (size_t offset : kOffsets) {
+      for (size_t trailing_size : kTrailingSizes) {
+        std::string text = Embed(sequence, offset, trailing_size);
+        EXPECT_EQ(FindInvalidOffset(text), U8CheckOffset(text))
+            << "offset " << offset << ", trailing " << trailing_size;
+        EXPECT_EQ(FindInvalidOffset(text), static_cast<ptrdiff_t>(offset));
+      }
+    }
+  }
+}
+
+TEST(Utf8CheckTest, InvalidSequencesAfterMultibyteText) {
+  // The bytes before the invalid sequence are not all ASCII, so the scan is not a single skip.
+  for (const char *sequence : kInvalidSequences) {
+    for (size_t offset : kOffsets) {
+      std::string text = std::string(offset, 'a') + "\xC3\xA9" + sequence + "\xE2\x82\xAC";
+      EXPECT_EQ(FindInvalidOffset(text), U8CheckOffset(text)) << "offset " << offset;
+    }
+  }
+}
+
+TEST(Utf8CheckTest, TruncatedAtEnd) {
+  for (const char *sequence : kValidSequences) {
+    std::string complete(sequence);
+    for (size_t length = 1; length < complete.size(); ++length) {
+      for (size_t offset : kOffsets) {
+        std::string text = Embed(complete.substr(0, length), offset, 0);
+        EXPECT_EQ(FindInvalidOffset(text), U8CheckOffset(text))
+            << "offset " << offset << ", length " << length;
+        EXPECT_EQ(FindInvalidOffset(text), static_cast<ptrdiff_t>(offset));
+      }
+    }
+  }
+}
+
+TEST(Utf8CheckTest, RandomText) {
+  // Mostly ASCII with some multi-byte sequences and random bytes, such that both long ASCII runs
+  // and invalid bytes at arbitrary offsets occur.
+  std::srand(42);
+  for (int i = 0; i < 2000; ++i) {
+    std::string text;
+    size_t size = std::rand() % 300;
+    while (text.size() < size) {
+      int kind = std::rand() % 100;
+      if (kind < 85) {
+        text.push_back('a' + std::rand() % 26);
+      } else if (kind < 95) {
+        text.append(kValidSequences[std::rand() % (sizeof(kValidSequences) / sizeof(char *))]);
+      } else {
+        text.push_back(static_cast<char>(0x80 + std::rand() % 0x80));
+      }
+    }
+    EXPECT_EQ(FindInvalidOffset(text), U8CheckOffset(text)) << "iteration " << i;
+  }
+}
+
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}